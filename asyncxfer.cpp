@@ -0,0 +1,214 @@
+/* asyncxfer - moves many files at once on a single thread with the
+   coroutine API in ipcxfer/async.h, optionally in priority classes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <vector>
+#include "ipcxfer/ipcxfer.h"
+
+/* Totals over all transfers */
+int failures = 0;
+long totalBytes = 0;
+
+/**
+ * A class given with -C, and the transfers to run in it
+ */
+
+struct classSpec
+{
+	QosClass* qos;
+	const char* fileName;
+	int count;
+};
+
+std::vector<classSpec> classes;
+
+/**
+ * Parses a class given with -C
+ * @param spec - name:priority:weight:cap in MiB/s (0 for none):count:file
+ * @return true on success
+ */
+bool parseClass(const char* spec)
+{
+	char name[64];
+	int priority, count, consumed = 0;
+	unsigned int weight;
+	double capMiB;
+	if (sscanf(spec, "%63[^:]:%d:%u:%lf:%d:%n", name, &priority, &weight, &capMiB, &count, &consumed) != 5 ||
+		consumed == 0 || spec[consumed] == '\0' || count < 1) {
+		fprintf(stderr, "bad class %s, expected name:priority:weight:cap MiB/s:count:file\n", spec);
+		return false;
+	}
+	classSpec added;
+	added.qos = new QosClass(strdup(name), priority, weight, (long)(capMiB * (1 << 20)));
+	added.fileName = spec + consumed;
+	added.count = count;
+	classes.push_back(added);
+	return true;
+}
+
+/**
+ * Receives one file into recvfile.<n>, then closes its channel
+ * @param loop - the event loop
+ * @param channel - an accepted channel, freed when done
+ * @param n - the number of the transfer
+ */
+Task<long> receiveOne(EventLoop& loop, AsyncChannel* channel, int n)
+{
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), "recvfile.%d", n);
+
+	long result = -1;
+	int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		fprintf(stderr, "failed to open file for received data: %s\n", fileName);
+	} else {
+		result = co_await receiveInto(loop, *channel, fd);
+		close(fd);
+	}
+
+	if (result < 0) {
+		fprintf(stdout, "%s: file transfer failed\n", fileName);
+		failures++;
+	} else {
+		totalBytes += result;
+	}
+	delete channel;
+	co_return result;
+}
+
+/**
+ * Accepts channels and starts a receiving coroutine for each
+ * @param loop - the event loop
+ * @param listener - the listening name
+ * @param count - how many transfers to accept
+ */
+Task<long> acceptAll(EventLoop& loop, AsyncListener& listener, int count)
+{
+	for (int n = 0; n < count; n++) {
+		AsyncChannel* channel = new AsyncChannel;
+		if (!co_await listener.accept(loop, *channel)) {
+			delete channel;
+			failures += count - n;
+			co_return -1;
+		}
+		loop.spawn(receiveOne(loop, channel, n));
+	}
+	co_return count;
+}
+
+/**
+ * Sends one copy of a file over its own channel
+ * @param loop - the event loop
+ * @param channelName - the name the receiver listens on
+ * @param fileName - the file
+ * @param qos - its class, or NULL
+ */
+Task<long> sendOne(EventLoop& loop, const char* channelName, const char* fileName, QosClass* qos)
+{
+	AsyncChannel channel;
+	long result = -1;
+
+	int fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "File does not exist or is not accessible: %s\n", fileName);
+	} else {
+		if (co_await channel.connect(loop, channelName)) {
+			result = co_await sendFile(loop, channel, fd, NULL, qos);
+		}
+		close(fd);
+	}
+
+	if (result < 0) {
+		failures++;
+	} else {
+		totalBytes += result;
+	}
+	co_return result;
+}
+
+int main(int argc, char** argv)
+{
+	const char* program = argv[0];
+	int opt;
+	while ((opt = getopt(argc, argv, "C:")) != -1)
+	{
+		if (opt != 'C' || !parseClass(optarg)) {
+			argc = 0; // print the usage below
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	if (argc < 3 || (strcmp(argv[1], "recv") != 0 && strcmp(argv[1], "send") != 0) ||
+		(strcmp(argv[1], "send") == 0 && argc < 4 && classes.empty())) {
+		fprintf(stdout, "asyncxfer - transfers many files at once on one thread\n");
+		fprintf(stderr, "USAGE: %s recv <channel> [count]\n"
+			"       %s send <channel> <FILE NAME> [count]\n"
+			"       %s send -C <class> [-C <class> ...] <channel>\n"
+			"a class is name:priority:weight:cap MiB/s (0 for none):count:file\n", program, program, program);
+		exit(-1);
+	}
+	bool receiving = strcmp(argv[1], "recv") == 0;
+	const char* channelName = argv[2];
+	int count = argc > (receiving ? 3 : 4) ? atoi(argv[receiving ? 3 : 4]) : 1;
+	if (count < 1) {
+		fprintf(stderr, "count must be at least 1\n");
+		exit(-1);
+	}
+
+	/* Transfers given as classes replace the plain ones */
+	if (!receiving && !classes.empty()) {
+		count = 0;
+		for (const classSpec& spec : classes) {
+			count += spec.count;
+		}
+	}
+
+	EventLoop loop;
+	AsyncListener listener;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (receiving) {
+		/* The receiver listens first; senders connect to it by name */
+		if (!listener.listen(channelName)) {
+			exit(-1);
+		}
+		fprintf(stdout, "Waiting for %d transfers on %s...\n", count, channelName);
+		fflush(stdout);
+		loop.spawn(acceptAll(loop, listener, count));
+	} else if (classes.empty()) {
+		for (int n = 0; n < count; n++) {
+			loop.spawn(sendOne(loop, channelName, argv[3], NULL));
+		}
+	} else {
+		/* Interleaved, so no class gets a head start */
+		for (int n = 0, started = 0; started < count; n++) {
+			for (const classSpec& spec : classes) {
+				if (n < spec.count) {
+					loop.spawn(sendOne(loop, channelName, spec.fileName, spec.qos));
+					started++;
+				}
+			}
+		}
+	}
+
+	if (!loop.run()) {
+		exit(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stdout, "%d of %d transfers complete, %ld bytes in %.3f s (%.1f MiB/s)\n",
+		count - failures, count, totalBytes, seconds, totalBytes / seconds / (1 << 20));
+	for (const classSpec& spec : classes) {
+		spec.qos->report(stdout);
+	}
+	return failures == 0 ? 0 : -1;
+}
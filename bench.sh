@@ -0,0 +1,73 @@
+#!/bin/sh
+# Times the transfer of a generated file over each transport and checks
+# that the received copy matches. CPU is the user + system time of send
+# and recv together, which shows what spinning costs.
+# USAGE: ./bench.sh [size in MiB] [transport ...]
+# The transports unix and tcp send over a UNIX domain socket and over
+# TCP on loopback (-a), to compare with the local transports.
+# Environment:
+#   WAIT="block spin adaptive"   wait strategies to compare (default block)
+#   SEND_CPU=n RECV_CPU=m        pin send and recv to these CPUs
+#   KEY=<key file>               also time each transport encrypted (-K)
+#   PORT=5555                    the port of the tcp transport
+
+SIZE=${1:-64}
+[ $# -gt 0 ] && shift
+TRANSPORTS=${*:-"shm splice cma bcast"}
+WAIT=${WAIT:-block}
+DATAFILE=benchfile.dat
+
+SENDOPTS=${SEND_CPU:+-c $SEND_CPU}
+RECVOPTS=${RECV_CPU:+-c $RECV_CPU}
+
+# Without a key only plaintext runs; "-" stands for no key
+KEYS=-
+[ -n "$KEY" ] && KEYS="- $KEY"
+
+head -c $((SIZE * 1024 * 1024)) /dev/urandom > $DATAFILE
+
+printf "%-8s %-9s %-5s %9s %12s %9s\n" transport wait key seconds MiB/s CPU
+for t in $TRANSPORTS; do
+	for w in $WAIT; do
+		for k in $KEYS; do
+			KEYOPTS=
+			[ "$k" != - ] && KEYOPTS="-K $k"
+
+			# Both sides of a socket name its address
+			case $t in
+				unix) SENDT="-a unix:bench.sock"; RECVT=$SENDT ;;
+				tcp) SENDT="-a tcp:127.0.0.1:${PORT:-5555}"; RECVT=$SENDT ;;
+				*) SENDT="-t $t"; RECVT= ;;
+			esac
+			# Only shm and bcast can be encrypted
+			case $t in
+				shm|bcast) ;;
+				*) [ -n "$KEYOPTS" ] && continue ;;
+			esac
+			rm -f recvfile
+			RESULT=$(
+				START=$(date +%s.%N)
+				./recv -w $w $RECVT $RECVOPTS $KEYOPTS > /dev/null &
+				RECVPID=$!
+				# A send that fails may leave recv waiting for it
+				./send $SENDT -w $w $SENDOPTS $KEYOPTS $DATAFILE > /dev/null || kill $RECVPID 2> /dev/null
+				wait
+				END=$(date +%s.%N)
+				echo $START $END
+				times
+			)
+
+			if cmp -s $DATAFILE recvfile; then
+				echo "$RESULT" | awk -v t=$t -v w=$w -v k=$([ "$k" = - ] && echo no || echo yes) -v size=$SIZE '
+					function secs(v) { split(v, a, "m"); sub("s", "", a[2]); return a[1] * 60 + a[2] }
+					NR == 1 { wall = $2 - $1 }
+					NR == 3 { cpu = secs($1) + secs($2) }
+					END { printf "%-8s %-9s %-5s %9.3f %12.1f %9.3f\n", t, w, k, wall, size / wall, cpu }'
+			else
+				echo "$t $w $k: received file does not match"
+			fi
+		done
+	done
+done
+
+rm -f $DATAFILE
@@ -0,0 +1,50 @@
+/* CPU pinning and NUMA placement of shared segments */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Pins the calling process to one CPU
+ * @param cpu - the CPU number
+ * @return 0 on success, -1 on failure
+ */
+
+inline int pinToCpu(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * Asks for the pages of a shared segment to come from the NUMA node of
+ * the CPU we run on. The policy belongs to the segment, so it holds for
+ * every process attached to it, but only pages nobody has touched yet
+ * are placed by it: call it right after attaching.
+ * @param addr - the attached segment
+ * @param size - the size of the segment
+ * @return 0 on success, -1 on failure
+ */
+
+inline int placeOnLocalNode(void* addr, size_t size)
+{
+	unsigned int cpu, node;
+	if (getcpu(&cpu, &node) == -1) {
+		return -1;
+	}
+	unsigned long nodeMask[16] = {0};
+	const unsigned int bits = sizeof(nodeMask[0]) * 8;
+	if (node >= sizeof(nodeMask) * 8) {
+		return -1;
+	}
+	nodeMask[node / bits] |= 1UL << (node % bits);
+	return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodeMask, sizeof(nodeMask) * 8, 0);
+}
+
+#endif
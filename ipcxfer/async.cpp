@@ -0,0 +1,631 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/shm.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "async.h"
+#include "io.h"
+
+/* The most events handled per epoll_wait */
+#define ASYNC_MAX_EVENTS 64
+
+/**
+ * The CLOCK_MONOTONIC time in nanoseconds
+ */
+static long long nowNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+QosClass::QosClass(const char* name, int priority, unsigned int weight, long rateCap)
+	: name(name), priority(priority), weight(weight > 0 ? weight : 1), rateCap(rateCap),
+	  tokens(0), refilled(nowNs()), virtualTime(0), bytes(0), firstMoved(0), lastMoved(0),
+	  transfers(0), transferNs(0), transferMaxNs(0)
+{
+	memset(waits, 0, sizeof(waits));
+}
+
+void QosClass::moved(long size)
+{
+	long long now = nowNs();
+	if (bytes == 0) {
+		firstMoved = now;
+	}
+	lastMoved = now;
+	bytes += size;
+	tokens -= size;
+	virtualTime += (double)size / weight;
+}
+
+void QosClass::finished(long long ns)
+{
+	transfers++;
+	transferNs += ns;
+	transferMaxNs = ns > transferMaxNs ? ns : transferMaxNs;
+}
+
+/**
+ * Finds the wait under which a share of the chunks waited
+ * @param waits - the histogram
+ * @param share - e.g. 0.99
+ * @return the bucket's upper bound in microseconds
+ */
+static unsigned long long waitPercentile(const unsigned long* waits, double share)
+{
+	unsigned long total = 0, seen = 0;
+	for (int i = 0; i < QOS_WAIT_BUCKETS; i++) {
+		total += waits[i];
+	}
+	for (int i = 0; i < QOS_WAIT_BUCKETS; i++) {
+		seen += waits[i];
+		if (seen > 0 && seen >= share * total) {
+			return 1ULL << i;
+		}
+	}
+	return 0;
+}
+
+void QosClass::report(FILE* fp) const
+{
+	double seconds = (lastMoved - firstMoved) / 1e9;
+	fprintf(fp, "%-12s %5ld transfers %10.1f MiB %9.1f MiB/s   transfer avg %8.2f ms max %8.2f ms"
+		"   chunk wait p50 < %llu us p99 < %llu us\n",
+		name, transfers, bytes / (double)(1 << 20), seconds > 0 ? bytes / seconds / (1 << 20) : 0.0,
+		transfers > 0 ? transferNs / 1e6 / transfers : 0.0, transferMaxNs / 1e6,
+		waitPercentile(waits, 0.5), waitPercentile(waits, 0.99));
+}
+
+EventLoop::EventLoop() : stopped(false), live(0), virtualTime(0)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd == -1 || wakeFd == -1) {
+		fprintf(stderr, "failed to set up event loop: %s\n", strerror(errno));
+		return;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = wakeFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+		fprintf(stderr, "failed to set up event loop: %s\n", strerror(errno));
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	if (wakeFd != -1) {
+		::close(wakeFd);
+	}
+	if (epollFd != -1) {
+		::close(epollFd);
+	}
+}
+
+bool EventLoop::arm(Waiter& waiter)
+{
+	for (int i = 0; i < waiter.count; i++) {
+		int fd = waiter.fds[i];
+
+		/* One shot, so a descriptor only reports once per wait. It stays
+		   registered while disarmed, and is modified to rearm it. */
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+			(errno != ENOENT || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)) {
+			fprintf(stderr, "failed to poll descriptor %d: %s\n", fd, strerror(errno));
+			for (int j = 0; j < i; j++) {
+				waiters[waiter.fds[j]] = NULL;
+			}
+			waiter.fired = -1;
+			return false;
+		}
+		if ((size_t)fd >= waiters.size()) {
+			waiters.resize(fd + 1, NULL);
+		}
+		waiters[fd] = &waiter;
+	}
+	return true;
+}
+
+void EventLoop::enqueue(QosClass* qos, std::coroutine_handle<> h)
+{
+	if (qos->waiting.empty()) {
+		queued.push_back(qos);
+		qos->virtualTime = qos->virtualTime > virtualTime ? qos->virtualTime : virtualTime;
+	}
+	qos->waiting.push_back(h);
+	qos->queuedAt.push_back(nowNs());
+}
+
+int EventLoop::grant()
+{
+	if (queued.empty()) {
+		return -1;
+	}
+
+	/* Top up the buckets, and pick among the classes within their cap */
+	long long now = nowNs();
+	long long soonest = -1;
+	size_t best = queued.size();
+	for (size_t i = 0; i < queued.size(); i++) {
+		QosClass* qos = queued[i];
+		if (qos->rateCap > 0) {
+			double burst = qos->rateCap * QOS_BURST_SECONDS > ASYNC_SLOT_SIZE ? qos->rateCap * QOS_BURST_SECONDS : ASYNC_SLOT_SIZE;
+			qos->tokens += (now - qos->refilled) / 1e9 * qos->rateCap;
+			qos->tokens = qos->tokens < burst ? qos->tokens : burst;
+			qos->refilled = now;
+			if (qos->tokens <= 0) {
+				long long ready = (long long)(-qos->tokens * 1e9 / qos->rateCap) + 1;
+				soonest = soonest == -1 || ready < soonest ? ready : soonest;
+				continue;
+			}
+		}
+		if (best == queued.size() || qos->priority > queued[best]->priority ||
+			(qos->priority == queued[best]->priority && qos->virtualTime < queued[best]->virtualTime)) {
+			best = i;
+		}
+	}
+	if (best == queued.size()) {
+		return (int)((soonest + 999999) / 1000000);
+	}
+
+	QosClass* qos = queued[best];
+	std::coroutine_handle<> h = qos->waiting.front();
+	long long waited = (now - qos->queuedAt.front()) / 1000;
+	int bucket = 0;
+	while (bucket < QOS_WAIT_BUCKETS - 1 && (1LL << bucket) <= waited) {
+		bucket++;
+	}
+	qos->waits[bucket]++;
+	qos->waiting.pop_front();
+	qos->queuedAt.pop_front();
+	if (qos->waiting.empty()) {
+		queued.erase(queued.begin() + best);
+	}
+	virtualTime = qos->virtualTime;
+
+	/* It moves its chunk, accounted by moved(), then waits again */
+	h.resume();
+	return queued.empty() ? -1 : 0;
+}
+
+bool EventLoop::run()
+{
+	struct epoll_event events[ASYNC_MAX_EVENTS];
+
+	while (live > 0 && !stopped.load(std::memory_order_acquire))
+	{
+		/* Coroutines queue for turns as they run, spawned ones included;
+		   grant one before each round of events, and only sleep if none
+		   can go now */
+		int timeout = grant();
+		if (live == 0) {
+			break;
+		}
+		int count = epoll_wait(epollFd, events, ASYNC_MAX_EVENTS, timeout);
+		if (count == -1 && errno == EINTR) {
+			continue;
+		}
+		if (count == -1) {
+			fprintf(stderr, "failed to wait for events: %s\n", strerror(errno));
+			return false;
+		}
+
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+			if (fd == wakeFd) {
+				uint64_t value;
+				if (read(wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+					fprintf(stderr, "failed to read wakeup: %s\n", strerror(errno));
+				}
+				continue;
+			}
+
+			/* Forget the waiter under all its descriptors before resuming
+			   it, so a second event for it in this batch is dropped */
+			Waiter* waiter = (size_t)fd < waiters.size() ? waiters[fd] : NULL;
+			if (waiter == NULL) {
+				continue;
+			}
+			for (int j = 0; j < waiter->count; j++) {
+				waiters[waiter->fds[j]] = NULL;
+			}
+			waiter->fired = fd;
+			waiter->handle.resume();
+		}
+	}
+	return true;
+}
+
+void EventLoop::stop()
+{
+	stopped.store(true, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(wakeFd, &one, sizeof(one)) == -1) {
+		fprintf(stderr, "failed to wake event loop: %s\n", strerror(errno));
+	}
+}
+
+/**
+ * Builds the abstract socket address for a channel name
+ * @param name - the channel name
+ * @param addr - where to store the address
+ * @return the length of the address
+ */
+static socklen_t channelAddress(const char* name, struct sockaddr_un* addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	/* A leading NUL puts the name in the abstract namespace */
+	int length = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "ipcxfer/%s", name);
+	if (length >= (int)sizeof(addr->sun_path) - 1) {
+		length = sizeof(addr->sun_path) - 2;
+	}
+	return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/**
+ * Sends an int and a file descriptor over a UNIX socket
+ * @param sock - the socket
+ * @param value - the int
+ * @param fd - the descriptor to pass
+ * @return true on success
+ */
+static bool sendDescriptor(int sock, int value, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = {&value, sizeof(value)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(value)) {
+		fprintf(stderr, "failed to send channel setup: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Receives an int and a file descriptor sent by sendDescriptor
+ * @param sock - the socket
+ * @param value - where to store the int
+ * @return the descriptor, -1 on failure, or -2 if nothing has arrived yet
+ */
+static int recvDescriptor(int sock, int* value)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {value, sizeof(*value)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (result == -1 && errno == EAGAIN) {
+		return -2;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (result != sizeof(*value) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "failed to receive channel setup: %s\n", result == -1 ? strerror(errno) : "peer hung up");
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/**
+ * Waits for the peer's half of the setup
+ * @param value - where to store the int it sent
+ * @return its eventfd, or -1 on failure
+ */
+static Task<int> awaitDescriptor(EventLoop& loop, int sock, int* value)
+{
+	int fd;
+	while ((fd = recvDescriptor(sock, value)) == -2) {
+		if (co_await loop.readable(sock) == -1) {
+			co_return -1;
+		}
+	}
+	co_return fd;
+}
+
+AsyncChannel::AsyncChannel() : sock(-1), bell(-1), peerBell(-1), ringPtr(NULL) {}
+
+AsyncChannel::~AsyncChannel()
+{
+	close();
+}
+
+void AsyncChannel::close()
+{
+	if (ringPtr != NULL && shmdt(ringPtr) == -1) {
+		fprintf(stderr, "failed to detach channel ring: %s\n", strerror(errno));
+	}
+	int* fds[] = {&sock, &bell, &peerBell};
+	for (int* fd : fds) {
+		if (*fd != -1) {
+			::close(*fd);
+			*fd = -1;
+		}
+	}
+	ringPtr = NULL;
+}
+
+Task<bool> AsyncChannel::connect(EventLoop& loop, const char* name)
+{
+	struct sockaddr_un addr;
+	socklen_t length = channelAddress(name, &addr);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1 || ::connect(sock, (struct sockaddr*)&addr, length) == -1) {
+		fprintf(stderr, "failed to connect to channel %s: %s\n", name, strerror(errno));
+		close();
+		co_return false;
+	}
+
+	/* The listener sends the ring and its eventfd; we attach before
+	   answering with ours, after which it removes the ring's id */
+	int ringId;
+	if ((peerBell = co_await awaitDescriptor(loop, sock, &ringId)) == -1) {
+		close();
+		co_return false;
+	}
+	if ((ringPtr = (asyncRing*)shmat(ringId, NULL, 0)) == (asyncRing*)-1) {
+		fprintf(stderr, "failed to attach channel ring: %s\n", strerror(errno));
+		ringPtr = NULL;
+		close();
+		co_return false;
+	}
+	if ((bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 || !sendDescriptor(sock, 0, bell)) {
+		close();
+		co_return false;
+	}
+	co_return true;
+}
+
+bool AsyncChannel::passed(unsigned int* counter, unsigned int seq, int who)
+{
+	if ((int)(__atomic_load_n(counter, __ATOMIC_ACQUIRE) - seq) > 0) {
+		return true;
+	}
+
+	/* Pairs with publish(): either the peer sees our flag and rings, or
+	   we see its new counter here */
+	__atomic_store_n(&ringPtr->waiting[who], 1, __ATOMIC_SEQ_CST);
+	if ((int)(__atomic_load_n(counter, __ATOMIC_SEQ_CST) - seq) > 0) {
+		__atomic_store_n(&ringPtr->waiting[who], 0, __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+Task<bool> AsyncChannel::waitPast(EventLoop& loop, unsigned int* counter, unsigned int seq, int who)
+{
+	bool gone = false;
+
+	do {
+		int fd = co_await loop.readable(bell, sock);
+		if (fd == bell) {
+			uint64_t count;
+			if (read(bell, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+				fprintf(stderr, "failed to read channel eventfd: %s\n", strerror(errno));
+				gone = true;
+			}
+		} else {
+			/* The socket only becomes readable when the peer closes it */
+			char c;
+			gone = fd == -1 || recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || errno != EAGAIN;
+		}
+	} while (!passed(counter, seq, who) && !gone);
+
+	/* The peer may have moved the counter before it went away */
+	__atomic_store_n(&ringPtr->waiting[who], 0, __ATOMIC_RELAXED);
+	co_return (int)(__atomic_load_n(counter, __ATOMIC_ACQUIRE) - seq) > 0;
+}
+
+void AsyncChannel::publish(unsigned int* counter, unsigned int value, int peer)
+{
+	__atomic_store_n(counter, value, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ringPtr->waiting[peer], __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(peerBell, &one, sizeof(one)) == -1) {
+			fprintf(stderr, "failed to ring channel eventfd: %s\n", strerror(errno));
+		}
+	}
+}
+
+AsyncListener::AsyncListener() : sock(-1) {}
+
+AsyncListener::~AsyncListener()
+{
+	close();
+}
+
+void AsyncListener::close()
+{
+	if (sock != -1) {
+		::close(sock);
+		sock = -1;
+	}
+}
+
+bool AsyncListener::listen(const char* name)
+{
+	struct sockaddr_un addr;
+	socklen_t length = channelAddress(name, &addr);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1 || bind(sock, (struct sockaddr*)&addr, length) == -1 || ::listen(sock, SOMAXCONN) == -1) {
+		fprintf(stderr, "failed to listen on channel %s: %s\n", name, strerror(errno));
+		close();
+		return false;
+	}
+	return true;
+}
+
+Task<bool> AsyncListener::accept(EventLoop& loop, AsyncChannel& channel)
+{
+	while ((channel.sock = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+			fprintf(stderr, "failed to accept channel: %s\n", strerror(errno));
+			co_return false;
+		}
+		if (co_await loop.readable(sock) == -1) {
+			co_return false;
+		}
+	}
+
+	/* A fresh private ring; shared memory starts zeroed, so the counters are 0 */
+	int ringId = shmget(IPC_PRIVATE, sizeof(asyncRing), 0600 | IPC_CREAT);
+	if (ringId == -1) {
+		fprintf(stderr, "failed to obtain channel ring: %s\n", strerror(errno));
+		channel.close();
+		co_return false;
+	}
+	if ((channel.ringPtr = (asyncRing*)shmat(ringId, NULL, 0)) == (asyncRing*)-1) {
+		fprintf(stderr, "failed to attach channel ring: %s\n", strerror(errno));
+		channel.ringPtr = NULL;
+	}
+
+	bool result = channel.ringPtr != NULL &&
+		(channel.bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1 &&
+		sendDescriptor(channel.sock, ringId, channel.bell);
+	int unused;
+	if (result) {
+		result = (channel.peerBell = co_await awaitDescriptor(loop, channel.sock, &unused)) != -1;
+	}
+
+	/* The peer has attached (or never will), so the ring can go as soon
+	   as both sides detach, even if one of them crashes */
+	if (shmctl(ringId, IPC_RMID, NULL) == -1) {
+		fprintf(stderr, "failed to deallocate channel ring: %s\n", strerror(errno));
+	}
+	if (!result) {
+		channel.close();
+	}
+	co_return result;
+}
+
+Task<long> sendFile(EventLoop& loop, AsyncChannel& channel, int fd, progressFn progress, QosClass* qos)
+{
+	asyncRing* ringPtr = channel.ring();
+	FdIO io(fd);
+	unsigned int seq = ringPtr->head;
+	long total = 0;
+	bool failed = false;
+	ssize_t size;
+	long long start = nowNs();
+
+	do
+	{
+		/* Wait for the slot to come back */
+		unsigned int reuse = seq - ASYNC_SLOT_COUNT;
+		if (!channel.passed(&ringPtr->tail, reuse, ASYNC_SENDER) &&
+			!co_await channel.waitPast(loop, &ringPtr->tail, reuse, ASYNC_SENDER)) {
+			co_return -1;
+		}
+
+		/* A read error ends the file early and fails the transfer */
+		co_await loop.turn(qos);
+		if ((size = io.read(ringPtr->slots[seq % ASYNC_SLOT_COUNT], ASYNC_SLOT_SIZE)) < 0) {
+			fprintf(stderr, "failed to read from file: %s\n", strerror(errno));
+			failed = true;
+			size = 0;
+		}
+		if (qos != NULL) {
+			qos->moved(size);
+		}
+		ringPtr->sizes[seq % ASYNC_SLOT_COUNT] = size;
+		channel.publish(&ringPtr->head, seq + 1, ASYNC_RECEIVER);
+
+		total += size;
+		if (progress != NULL && size > 0) {
+			progress(total, size);
+		}
+		seq++;
+	} while (size > 0);
+
+	/* The receiver releases the end marker once it has everything */
+	if (!channel.passed(&ringPtr->tail, seq - 1, ASYNC_SENDER) &&
+		!co_await channel.waitPast(loop, &ringPtr->tail, seq - 1, ASYNC_SENDER)) {
+		co_return -1;
+	}
+	if (qos != NULL && !failed) {
+		qos->finished(nowNs() - start);
+	}
+	co_return failed ? -1 : total;
+}
+
+Task<long> receiveInto(EventLoop& loop, AsyncChannel& channel, int fd, progressFn progress, QosClass* qos)
+{
+	asyncRing* ringPtr = channel.ring();
+	FdIO io(fd);
+	long total = 0;
+	bool failed = false;
+	long long start = nowNs();
+
+	for (unsigned int seq = ringPtr->tail;; seq++)
+	{
+		if (!channel.passed(&ringPtr->head, seq, ASYNC_RECEIVER) &&
+			!co_await channel.waitPast(loop, &ringPtr->head, seq, ASYNC_RECEIVER)) {
+			co_return -1;
+		}
+
+		/* The size comes from shared memory: never write past the slot */
+		int size = ringPtr->sizes[seq % ASYNC_SLOT_COUNT];
+		if (size < 0 || size > ASYNC_SLOT_SIZE) {
+			fprintf(stderr, "The sender announced a chunk of %d bytes\n", size);
+			co_return -1;
+		}
+
+		/* After a write error keep releasing slots, so the sender finishes */
+		if (size > 0) {
+			co_await loop.turn(qos);
+		}
+		if (size > 0 && !failed && !io.write(ringPtr->slots[seq % ASYNC_SLOT_COUNT], size)) {
+			fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
+			failed = true;
+		}
+		if (qos != NULL && size > 0) {
+			qos->moved(size);
+		}
+		channel.publish(&ringPtr->tail, seq + 1, ASYNC_SENDER);
+		if (size == 0) {
+			break;
+		}
+
+		total += size;
+		if (progress != NULL) {
+			progress(total, size);
+		}
+	}
+	if (qos != NULL && !failed) {
+		qos->finished(nowNs() - start);
+	}
+	co_return failed ? -1 : total;
+}
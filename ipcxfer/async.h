@@ -0,0 +1,486 @@
+/* Coroutine API for running transfers inside an event-loop based
+   service. A transfer is a coroutine that suspends whenever its peer is
+   not ready, and an EventLoop resumes it when a file descriptor says the
+   peer has moved, so one thread can multiplex any number of transfers
+   and never blocks in msgrcv or on a futex. Run one EventLoop per
+   thread to spread transfers over several threads.
+
+   Each channel is a private shared memory slot ring. System V queues and
+   futexes cannot be polled, so each side instead owns an eventfd that
+   the other side writes to when it advances a counter; the eventfds are
+   exchanged over a UNIX socket when the channel is set up, and the
+   socket stays open so a crashed peer shows up as a hangup.
+
+   Transfers given a QosClass take turns: each slot they fill or write
+   out waits for the loop to grant it, highest priority first, then by
+   weighted fair share, within each class's bandwidth cap.
+
+   Needs -std=c++20. */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <coroutine>
+#include <exception>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <stdio.h>
+#include "transport.h"
+
+/* The number of slots in a channel */
+#define ASYNC_SLOT_COUNT 4
+
+/* The size of each slot. Kept small, a service may hold thousands of channels */
+#define ASYNC_SLOT_SIZE (64 << 10)
+
+/* Indexes into asyncRing::waiting */
+#define ASYNC_SENDER 0
+#define ASYNC_RECEIVER 1
+
+/* The chunk wait histogram: bucket n counts waits of under 2^n microseconds */
+#define QOS_WAIT_BUCKETS 32
+
+/* A capped class may save up this many seconds of its rate as a burst */
+#define QOS_BURST_SECONDS 0.05
+
+/**
+ * The shared segment of a channel. Slot n of a file lives in
+ * slots[n % ASYNC_SLOT_COUNT]; the counters only ever grow, so a channel
+ * can carry several files one after the other.
+ */
+
+struct asyncRing
+{
+	/* How many slots the sender has filled, including ones marking the end of a file */
+	unsigned int head;
+
+	/* How many slots the receiver has written out */
+	unsigned int tail;
+
+	/* Set while the sender / receiver is waiting for its eventfd */
+	int waiting[2];
+
+	/* How many bytes each slot holds; 0 marks the end of a file */
+	int sizes[ASYNC_SLOT_COUNT];
+
+	/* The data */
+	char slots[ASYNC_SLOT_COUNT][ASYNC_SLOT_SIZE] __attribute__((aligned(4096)));
+};
+
+/**
+ * A coroutine returning a T. It starts when it is first awaited (or
+ * spawned on an EventLoop), and resumes its awaiter when it returns.
+ */
+
+template <class T>
+class Task
+{
+public:
+	struct promise_type
+	{
+		T value;
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object()
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		/* Hands control straight to the awaiter, without growing the stack */
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+			{
+				std::coroutine_handle<> next = h.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+		FinalAwaiter final_suspend() noexcept { return {}; }
+
+		void return_value(T result) { value = result; }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task()
+	{
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		handle.promise().continuation = caller;
+		return handle;
+	}
+	T await_resume() { return handle.promise().value; }
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * A class of transfers on an EventLoop, e.g. interactive or bulk. Pass
+ * the same class to every transfer that belongs to it; the loop shares
+ * slots between classes, not between transfers, and the class keeps the
+ * statistics report() prints.
+ */
+
+class QosClass
+{
+public:
+	/**
+	 * @param name - what report() calls it
+	 * @param priority - classes with a higher priority are always served first
+	 * @param weight - the share of the bandwidth among classes of equal priority
+	 * @param rateCap - the most bytes per second, or 0 for no cap
+	 */
+	QosClass(const char* name, int priority = 0, unsigned int weight = 1, long rateCap = 0);
+
+	/**
+	 * Accounts for a chunk moved in a granted turn; sendFile and
+	 * receiveInto call it
+	 * @param bytes - the bytes in the chunk
+	 */
+	void moved(long bytes);
+
+	/**
+	 * Accounts for a finished transfer
+	 * @param ns - how long it took
+	 */
+	void finished(long long ns);
+
+	/**
+	 * Prints the throughput, transfer times and chunk waits
+	 * @param fp - where to print
+	 */
+	void report(FILE* fp) const;
+
+private:
+	friend class EventLoop;
+
+	const char* name;
+	int priority;
+	unsigned int weight;
+	long rateCap;
+
+	/* The token bucket for the cap, in bytes, and when it was last topped up */
+	double tokens;
+	long long refilled;
+
+	/* Bytes served divided by weight, for the fair share */
+	double virtualTime;
+
+	/* The coroutines waiting for a turn, and since when */
+	std::deque<std::coroutine_handle<>> waiting;
+	std::deque<long long> queuedAt;
+
+	/* Statistics */
+	long bytes;
+	long long firstMoved;
+	long long lastMoved;
+	long transfers;
+	long long transferNs;
+	long long transferMaxNs;
+	unsigned long waits[QOS_WAIT_BUCKETS];
+};
+
+/**
+ * Resumes coroutines when the file descriptors they wait on become
+ * readable, and hands out turns to transfers that have a QosClass. Not
+ * thread safe, except for stop().
+ */
+
+class EventLoop
+{
+public:
+	EventLoop();
+	~EventLoop();
+
+	/**
+	 * Starts a coroutine that runs independently of its caller. It runs
+	 * until its first suspension before spawn returns; the loop frees it
+	 * when it finishes, and its result is dropped.
+	 * @param task - the coroutine
+	 */
+	template <class T>
+	void spawn(Task<T>&& task)
+	{
+		live++;
+		drive(std::move(task), &live);
+	}
+
+	/**
+	 * Resumes coroutines until every spawned one has finished or stop()
+	 * is called
+	 * @return false if epoll failed
+	 */
+	bool run();
+
+	/**
+	 * Makes run() return; may be called from any thread
+	 */
+	void stop();
+
+	/* Set up by readable() and filled in by the loop */
+	struct Waiter
+	{
+		std::coroutine_handle<> handle;
+		int fds[2];
+		int count;
+		int fired;
+	};
+
+	/**
+	 * Awaitable that suspends until one of up to two file descriptors
+	 * is readable or hung up, and returns which one (or -1 on failure)
+	 */
+	class Readable
+	{
+	public:
+		Readable(EventLoop& loop, int fd, int other) : loop(loop)
+		{
+			waiter.fds[0] = fd;
+			waiter.fds[1] = other;
+			waiter.count = other == -1 ? 1 : 2;
+			waiter.fired = -1;
+		}
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			waiter.handle = h;
+			return loop.arm(waiter);
+		}
+		int await_resume() { return waiter.fired; }
+
+	private:
+		EventLoop& loop;
+		Waiter waiter;
+	};
+
+	/**
+	 * Waits for a file descriptor, or either of two, to become readable
+	 * @param fd - the file descriptor
+	 * @param other - a second one, or -1
+	 */
+	Readable readable(int fd, int other = -1)
+	{
+		return Readable(*this, fd, other);
+	}
+
+	/**
+	 * Awaitable that suspends until the loop grants the class a turn
+	 */
+	class Turn
+	{
+	public:
+		Turn(EventLoop& loop, QosClass* qos) : loop(loop), qos(qos) {}
+		bool await_ready() { return qos == NULL; }
+		void await_suspend(std::coroutine_handle<> h) { loop.enqueue(qos, h); }
+		void await_resume() {}
+
+	private:
+		EventLoop& loop;
+		QosClass* qos;
+	};
+
+	/**
+	 * Waits for a turn to move one chunk. The loop grants one turn per
+	 * round of events: to the class with the highest priority, among
+	 * those the lowest bytes served per weight, that is within its cap.
+	 * Call qos->moved() with the chunk's size before suspending again.
+	 * @param qos - the transfer's class, or NULL to go at once
+	 */
+	Turn turn(QosClass* qos)
+	{
+		return Turn(*this, qos);
+	}
+
+private:
+	/* The epoll instance, and an eventfd that wakes it for stop() */
+	int epollFd;
+	int wakeFd;
+	std::atomic<bool> stopped;
+
+	/* Spawned coroutines that have not finished */
+	size_t live;
+
+	/* Who waits on each file descriptor, indexed by descriptor */
+	std::vector<Waiter*> waiters;
+
+	/* Classes with coroutines waiting for a turn */
+	std::vector<QosClass*> queued;
+
+	/* The virtual time of the class served last; an idle class that
+	   comes back starts from here, so it cannot claim the turns it missed */
+	double virtualTime;
+
+	/**
+	 * Queues a coroutine for a turn
+	 */
+	void enqueue(QosClass* qos, std::coroutine_handle<> h);
+
+	/**
+	 * Grants the next turn, if a class may have it
+	 * @return the epoll timeout until the next one: 0 if more are ready,
+	 *         the ms until a capped class may go again, or -1 if none wait
+	 */
+	int grant();
+
+	/**
+	 * Registers a waiter with epoll
+	 * @return true if it should suspend; false with fired = -1 on failure
+	 */
+	bool arm(Waiter& waiter);
+
+	/* Owns a spawned coroutine and frees itself when that finishes */
+	struct Detached
+	{
+		struct promise_type
+		{
+			Detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	template <class T>
+	static Detached drive(Task<T> task, size_t* live)
+	{
+		co_await task;
+		(*live)--;
+	}
+};
+
+/**
+ * One end of a channel. A channel carries files in one direction, from
+ * whichever end calls sendFile to the end that calls receiveInto.
+ */
+
+class AsyncChannel
+{
+public:
+	AsyncChannel();
+	~AsyncChannel();
+
+	/**
+	 * Connects to a service listening under a name (see AsyncListener)
+	 * @param loop - the loop to wait on
+	 * @param name - the channel name
+	 * @return true on success
+	 */
+	Task<bool> connect(EventLoop& loop, const char* name);
+
+	/**
+	 * Detaches from the ring and closes the descriptors. The peer sees a
+	 * hangup, and fails any transfer it is waiting on.
+	 */
+	void close();
+
+	/** The shared ring, once set up */
+	asyncRing* ring() { return ringPtr; }
+
+	/**
+	 * Checks whether a counter has passed seq. If not, flags us as
+	 * waiting, so the peer rings our eventfd when it moves the counter.
+	 * @param counter - &ring()->head or &ring()->tail
+	 * @param seq - the slot number
+	 * @param who - ASYNC_SENDER or ASYNC_RECEIVER
+	 */
+	bool passed(unsigned int* counter, unsigned int seq, int who);
+
+	/**
+	 * Suspends until a counter has passed seq; call after passed()
+	 * returned false
+	 * @return false if the peer went away or polling failed
+	 */
+	Task<bool> waitPast(EventLoop& loop, unsigned int* counter, unsigned int seq, int who);
+
+	/**
+	 * Moves a counter forward and rings the peer's eventfd if it is waiting
+	 * @param counter - &ring()->head or &ring()->tail
+	 * @param value - the new value
+	 * @param peer - ASYNC_RECEIVER when the sender publishes, and vice versa
+	 */
+	void publish(unsigned int* counter, unsigned int value, int peer);
+
+private:
+	friend class AsyncListener;
+
+	/* The socket the channel was set up over, kept to notice a hangup */
+	int sock;
+
+	/* Our eventfd, and the peer's */
+	int bell;
+	int peerBell;
+
+	asyncRing* ringPtr;
+};
+
+/**
+ * Accepts channels on a name. The name lives in the abstract UNIX socket
+ * namespace, so nothing is left behind in the file system.
+ */
+
+class AsyncListener
+{
+public:
+	AsyncListener();
+	~AsyncListener();
+
+	/**
+	 * Starts listening
+	 * @param name - the channel name senders connect to
+	 * @return true on success
+	 */
+	bool listen(const char* name);
+
+	/**
+	 * Waits for a connection and sets up its ring
+	 * @param loop - the loop to wait on
+	 * @param channel - an unused channel to set up
+	 * @return true on success
+	 */
+	Task<bool> accept(EventLoop& loop, AsyncChannel& channel);
+
+	void close();
+
+private:
+	int sock;
+};
+
+/**
+ * Sends a file over a channel
+ * @param loop - the loop to wait on
+ * @param channel - a connected or accepted channel
+ * @param fd - the file to send, read until its end
+ * @param progress - called after every chunk, or NULL
+ * @param qos - the class whose turns it fills slots in, or NULL
+ * @return the bytes sent, once the receiver has written all of them,
+ *         or -1 on failure
+ */
+Task<long> sendFile(EventLoop& loop, AsyncChannel& channel, int fd, progressFn progress = NULL, QosClass* qos = NULL);
+
+/**
+ * Receives one file from a channel
+ * @param loop - the loop to wait on
+ * @param channel - a connected or accepted channel
+ * @param fd - where to write the file
+ * @param progress - called after every chunk, or NULL
+ * @param qos - the class whose turns it writes slots out in, or NULL
+ * @return the bytes received, or -1 on failure
+ */
+Task<long> receiveInto(EventLoop& loop, AsyncChannel& channel, int fd, progressFn progress = NULL, QosClass* qos = NULL);
+
+#endif
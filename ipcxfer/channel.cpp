@@ -0,0 +1,273 @@
+#include <sys/shm.h>
+#include <sys/msg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "channel.h"
+#include "msg.h"
+#include "flow.h"
+#include "affinity.h"
+
+bool ipcOpen(int& shmid, int& msqid, void*& sharedMemPtr, bool withQueue, pid_t* lastPid, bool localNode)
+{
+	/* Get a unique key by using a file called keyfile.txt and call
+	   ftok("keyfile.txt", 'a') to generate it. The queue and the
+	   segment use the same key.
+	 */
+	key_t key = ftok("keyfile.txt", 'a');
+	if (key == -1) {
+		fprintf(stderr, "Failed to generate key: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* Whatever a crashed run left would block or corrupt this one */
+	if (ipcReap(key)) {
+		fprintf(stdout, "Removed shared memory and message queue left behind by a crashed transfer\n");
+	}
+
+	/* Allocate a piece of shared memory with size CHANNEL_SIZE,
+	   or get the one the other process allocated. Only our own user
+	   may attach, and the same goes for the queue. */
+	shmid = shmget(key, CHANNEL_SIZE, 0600 | IPC_CREAT);
+	if (shmid == -1) {
+		fprintf(stderr, "failed to obtain shared memory: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* Must be read before we attach and become the last process ourselves */
+	if (lastPid != NULL) {
+		*lastPid = shmLastPid(shmid);
+	}
+
+	/* Attach to the shared memory */
+	sharedMemPtr = shmat(shmid, NULL, 0);
+	if (sharedMemPtr == (void*)-1) {
+		fprintf(stderr, "failed to obtain shared memory pointer: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* Before anything below touches the header page and places it */
+	if (localNode && placeOnLocalNode(sharedMemPtr, CHANNEL_SIZE) == -1) {
+		fprintf(stderr, "failed to place shared memory on local NUMA node: %s\n", strerror(errno));
+	}
+
+	/* From now on, a segment nobody is attached to was abandoned */
+	unsigned int fresh = 0;
+	__atomic_compare_exchange_n(&channelHead(sharedMemPtr)->magic, &fresh, CHANNEL_MAGIC,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+	/* Attach to the message queue */
+	msqid = -1;
+	if (withQueue && (msqid = msgget(key, 0600 | IPC_CREAT)) == -1) {
+		fprintf(stderr, "failed to obtain message queue: %s\n", strerror(errno));
+		ipcDetach(sharedMemPtr);
+		sharedMemPtr = (void*)-1;
+		return false;
+	}
+	return true;
+}
+
+bool ipcReap(key_t key)
+{
+	int shmid = shmget(key, 0, 0);
+	int msqid = msgget(key, 0);
+	shmid_ds shmInfo;
+
+	if (shmid != -1) {
+		/* Anybody attached is alive: the kernel detaches a process that exits */
+		if (shmctl(shmid, IPC_STAT, &shmInfo) == -1 || shmInfo.shm_nattch != 0) {
+			return false;
+		}
+		if (shmInfo.shm_segsz == CHANNEL_SIZE) {
+			/* Only a segment that was set up can have been abandoned; a
+			   new one is waiting for its creator to attach */
+			void* ptr = shmat(shmid, NULL, SHM_RDONLY);
+			if (ptr == (void*)-1) {
+				return false;
+			}
+			bool setUp = __atomic_load_n(&channelHead(ptr)->magic, __ATOMIC_ACQUIRE) == CHANNEL_MAGIC;
+			shmdt(ptr);
+			if (!setUp) {
+				return false;
+			}
+		}
+		if (shmctl(shmid, IPC_RMID, NULL) == -1) {
+			fprintf(stderr, "Failed to deallocate stale shared memory: %s\n", strerror(errno));
+			return false;
+		}
+	} else if (msqid == -1) {
+		return false;
+	}
+
+	/* The queue is created after the segment, so without a live segment
+	   it is stale too */
+	if (msqid != -1 && msgctl(msqid, IPC_RMID, NULL) == -1) {
+		fprintf(stderr, "Failed to deallocate stale message queue: %s\n", strerror(errno));
+	}
+	if (unlink(SPLICE_FIFO_NAME) == -1 && errno != ENOENT) {
+		fprintf(stderr, "Failed to remove %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+	}
+	return true;
+}
+
+void ipcDetach(void* sharedMemPtr)
+{
+	if (sharedMemPtr != (void*)-1 && shmdt(sharedMemPtr) == -1) {
+		fprintf(stderr, "Failed to detach shared memory: %s\n", strerror(errno));
+	}
+}
+
+void ipcRemove(int shmid, int msqid)
+{
+	/* Deallocate the shared memory chunk */
+	if (shmid != -1 && shmctl(shmid, IPC_RMID, NULL) == -1) {
+		fprintf(stderr, "Failed to deallocate the shared memory: %s\n", strerror(errno));
+	}
+	/* Deallocate the message queue */
+	if (msqid != -1 && msgctl(msqid, IPC_RMID, NULL) == -1) {
+		fprintf(stderr, "Failed to deallocate message queue: %s\n", strerror(errno));
+	}
+	/* Remove the FIFO if the splice transport created one */
+	if (msqid != -1 && unlink(SPLICE_FIFO_NAME) == -1 && errno != ENOENT) {
+		fprintf(stderr, "Failed to remove %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+	}
+}
+
+void ipcDrain(int msqid)
+{
+	msqid_ds msqInfo;
+	for (int waited = 0; waited < IPC_DRAIN_MS; waited++) {
+		if (msgctl(msqid, IPC_STAT, &msqInfo) == -1 || msqInfo.msg_qnum == 0) {
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+pid_t queueSenderPid(int msqid)
+{
+	/* Info on the message queue */
+	msqid_ds msqInfo;
+	if (msgctl(msqid, IPC_STAT, &msqInfo) == -1) {
+		return -1;
+	}
+	// The sender sent the setup message, so its PID is stored in msg_lspid
+	return msqInfo.msg_lspid;
+}
+
+pid_t shmLastPid(int shmid)
+{
+	// Read info on shared memory segment
+	shmid_ds shmInfo;
+	if (shmctl(shmid, IPC_STAT, &shmInfo) == -1) {
+		return -1;
+	}
+	// The process that performed the last shared
+	// memory operation has its PID stored in shm_lpid
+	return shmInfo.shm_lpid;
+}
+
+pid_t waitShmPeer(int shmid)
+{
+	/* The PID of this process */
+	pid_t selfPid = getpid();
+	pid_t pid;
+
+	// Since we attached last, lpid contains our own PID until the other
+	// process attaches and lpid changes to its PID
+	while ((pid = shmLastPid(shmid)) == selfPid) {
+		sleep(1);
+	}
+	return pid;
+}
+
+ring* ringCreate(int& ringId, int readerCount, bool localNode)
+{
+	/* A private segment, attached by the id in the setup message */
+	ringId = shmget(IPC_PRIVATE, sizeof(ring), 0600 | IPC_CREAT);
+	if (ringId == -1) {
+		fprintf(stderr, "failed to obtain slot ring: %s\n", strerror(errno));
+		return (ring*)-1;
+	}
+	ring* ringPtr = (ring*)shmat(ringId, NULL, 0);
+	if (ringPtr == (ring*)-1) {
+		fprintf(stderr, "failed to obtain slot ring pointer: %s\n", strerror(errno));
+		shmctl(ringId, IPC_RMID, NULL);
+		ringId = -1;
+		return (ring*)-1;
+	}
+
+	/* Linux still lets receivers attach by id, and nothing leaks if we die */
+	if (shmctl(ringId, IPC_RMID, NULL) == -1) {
+		fprintf(stderr, "failed to mark slot ring for removal: %s\n", strerror(errno));
+	}
+	if (localNode && placeOnLocalNode(ringPtr, sizeof(ring)) == -1) {
+		fprintf(stderr, "failed to place slot ring on local NUMA node: %s\n", strerror(errno));
+	}
+	ringPtr->readerCount = readerCount;
+	ringPtr->readersLeft = readerCount;
+
+	/* Every reader starts out granting the first slot */
+	for (int i = 0; i < readerCount; i++) {
+		ringPtr->credits[i] = XFER_INITIAL_CREDIT;
+	}
+	return ringPtr;
+}
+
+ring* ringAttach(int ringId)
+{
+	ring* ringPtr = (ring*)shmat(ringId, NULL, 0);
+	if (ringPtr == (ring*)-1) {
+		fprintf(stderr, "failed to obtain slot ring pointer: %s\n", strerror(errno));
+	}
+	return ringPtr;
+}
+
+void ringRemove(int& ringId, ring*& ringPtr)
+{
+	/* ringCreate already marked it for removal */
+	if (ringPtr != (ring*)-1 && shmdt(ringPtr) == -1) {
+		fprintf(stderr, "failed to detach slot ring: %s\n", strerror(errno));
+	}
+	ringPtr = (ring*)-1;
+	ringId = -1;
+}
+
+int ringAwaitReaders(ring* ringPtr, int timeoutMs)
+{
+	long long deadline = monotonicMs() + timeoutMs;
+	for (;;) {
+		int waiting = 0;
+		for (int i = 0; i < ringPtr->readerCount; i++) {
+			waiting += __atomic_load_n(&ringPtr->readers[i].pid, __ATOMIC_ACQUIRE) == 0;
+		}
+		if (waiting == 0) {
+			return 0;
+		}
+		if (monotonicMs() >= deadline) {
+			break;
+		}
+		usleep(10000);
+	}
+
+	/* Nobody waits on the ring yet, so dropping needs no wake-up */
+	int missing = 0;
+	for (int i = 0; i < ringPtr->readerCount; i++) {
+		if (ownerClose(&ringPtr->readers[i])) {
+			__atomic_store_n(&ringPtr->dropped[i], 1, __ATOMIC_RELEASE);
+			missing++;
+		}
+	}
+	__atomic_sub_fetch(&ringPtr->readersLeft, missing, __ATOMIC_ACQ_REL);
+	return missing;
+}
+
+bool ringLeave(ring* ringPtr)
+{
+	bool last = __atomic_sub_fetch(&ringPtr->readersLeft, 1, __ATOMIC_ACQ_REL) == 0;
+	if (shmdt(ringPtr) == -1) {
+		fprintf(stderr, "Failed to detach slot ring: %s\n", strerror(errno));
+	}
+	return last;
+}
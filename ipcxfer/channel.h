@@ -0,0 +1,177 @@
+/* Setting up and tearing down the System V objects the programs share */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <sys/types.h>
+#include "msg.h"
+#include "ring.h"
+#include "watch.h"
+
+/* The longest ipcDrain waits for a peer that may have died */
+#define IPC_DRAIN_MS 1000
+
+/* Marks a keyed segment laid out with a channelHeader */
+#define CHANNEL_MAGIC 0x69707831
+
+/* Which owner record in the channelHeader is whose */
+#define OWNER_RECEIVER 0
+#define OWNER_SENDER 1
+
+/* The room the header takes at the start of the keyed segment */
+#define CHANNEL_HEADER_SIZE 128
+
+/* The size of the keyed segment: the header, then the chunk slots */
+#define CHANNEL_SIZE (CHANNEL_HEADER_SIZE + SHARED_MEMORY_SIZE)
+
+/**
+ * The start of the keyed segment, saying who is using it. A broadcast's
+ * receivers claim their records in the ring instead.
+ */
+
+struct channelHeader
+{
+	/* CHANNEL_MAGIC once the first process has set the segment up */
+	unsigned int magic;
+
+	/* The receiver's and the sender's claims */
+	owner owners[2];
+};
+
+static_assert(sizeof(channelHeader) <= CHANNEL_HEADER_SIZE, "channelHeader outgrew CHANNEL_HEADER_SIZE");
+
+/**
+ * Gets the header of the keyed segment
+ * @param sharedMemPtr - the attached segment
+ */
+inline channelHeader* channelHead(void* sharedMemPtr)
+{
+	return (channelHeader*)sharedMemPtr;
+}
+
+/**
+ * Gets the chunk slots after the header
+ * @param sharedMemPtr - the attached segment
+ */
+inline char* channelData(void* sharedMemPtr)
+{
+	return (char*)sharedMemPtr + CHANNEL_HEADER_SIZE;
+}
+
+/**
+ * Attaches to the shared memory segment, and the message queue if asked,
+ * keyed from keyfile.txt, creating them owner only (0600) if needed.
+ * Objects a crashed run left behind (see ipcReap) are removed first, so
+ * we start fresh.
+ * @param shmid - set to the id of the shared memory segment
+ * @param msqid - set to the id of the message queue, or -1
+ * @param sharedMemPtr - set to the attached segment
+ * @param withQueue - false for the signals programs, which use no queue
+ * @param lastPid - if not NULL, set to the PID of the last process to
+ *        attach to the segment before we did
+ * @param localNode - place the segment's pages on our NUMA node (see
+ *        placeOnLocalNode). Pages the peer touched first stay where they are.
+ * @return true on success; on failure whatever was attached is detached
+ */
+bool ipcOpen(int& shmid, int& msqid, void*& sharedMemPtr, bool withQueue, pid_t* lastPid = NULL, bool localNode = false);
+
+/**
+ * Removes the segment, queue and FIFO under a key if a crashed run left
+ * them behind: nobody is attached to a segment that was set up, or that
+ * is the wrong size for this build; or there is a queue but no segment.
+ * A segment just created by a process that has not attached yet is
+ * left alone.
+ * @param key - the key
+ * @return true if anything was removed
+ */
+bool ipcReap(key_t key);
+
+/**
+ * Detaches from the shared memory segment
+ * @param sharedMemPtr - the attached segment
+ */
+void ipcDetach(void* sharedMemPtr);
+
+/**
+ * Deallocates the shared memory segment, the message queue and the
+ * splice FIFO, once the transfer no longer needs them
+ * @param shmid - the id of the shared memory segment
+ * @param msqid - the id of the message queue, or -1
+ */
+void ipcRemove(int shmid, int msqid);
+
+/**
+ * Waits, for up to IPC_DRAIN_MS, until the peer has read every message
+ * left on the queue, so removing it does not throw away the last
+ * releases the sender is still counting
+ * @param msqid - the id of the message queue
+ */
+void ipcDrain(int msqid);
+
+/**
+ * Gets the PID of the sender. Must be called right after the setup
+ * message arrives, while the sender is still the last process that
+ * sent to the queue.
+ * @param msqid - the id of the message queue
+ * @return the PID, or -1 on failure
+ */
+pid_t queueSenderPid(int msqid);
+
+/**
+ * Gets the PID of the last process to attach to or detach from the
+ * shared memory segment
+ * @param shmid - the id of the shared memory segment
+ */
+pid_t shmLastPid(int shmid);
+
+/**
+ * Waits for another process to attach to the shared memory segment
+ * after us, and gets its PID
+ * @param shmid - the id of the shared memory segment
+ */
+pid_t waitShmPeer(int shmid);
+
+/**
+ * Creates and attaches a private broadcast ring. It is marked for
+ * removal at once, so it goes away when the last process detaches even
+ * if the sender dies; until then receivers can still attach by id.
+ * @param ringId - set to the id of the ring's segment
+ * @param readerCount - the number of receivers
+ * @param localNode - place the ring's pages on our NUMA node
+ * @return the ring, or (ring*)-1 on failure
+ */
+ring* ringCreate(int& ringId, int readerCount, bool localNode = false);
+
+/**
+ * Attaches to a broadcast ring named in a setup message
+ * @param ringId - the id of the ring's segment
+ * @return the ring, or (ring*)-1 on failure
+ */
+ring* ringAttach(int ringId);
+
+/**
+ * Detaches from a broadcast ring, which goes away once the receivers
+ * still attached detach too
+ * @param ringId - the id of the ring's segment; set to -1
+ * @param ringPtr - the attached ring; set to (ring*)-1
+ */
+void ringRemove(int& ringId, ring*& ringPtr);
+
+/**
+ * Waits for the receivers of a broadcast to claim their records in the
+ * ring. Those that have not within the timeout are closed (a late one
+ * is refused), dropped, and no longer counted among the receivers left.
+ * @param ringPtr - the attached ring
+ * @param timeoutMs - how long to wait
+ * @return how many never came
+ */
+int ringAwaitReaders(ring* ringPtr, int timeoutMs);
+
+/**
+ * Detaches a receiver from a broadcast ring
+ * @param ringPtr - the attached ring
+ * @return true if we were the last receiver to finish
+ */
+bool ringLeave(ring* ringPtr);
+
+#endif
@@ -0,0 +1,108 @@
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "transport.h"
+
+/**
+ * Maps a file for the receiver to read
+ * @param fd - the file to send
+ * @param size - the size of the file
+ * @return the mapping, or MAP_FAILED if the file cannot be mapped
+ *         (pipes and empty files)
+ */
+void* cmaMap(int fd, long size)
+{
+	void* fileMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (fileMap != MAP_FAILED) {
+		madvise(fileMap, size, MADV_SEQUENTIAL);
+	}
+	return fileMap;
+}
+
+/**
+ * Lets the receiver read our memory even when ptrace is restricted to
+ * ancestors (Yama), or takes that back. Only one process can be named.
+ * @param recvPid - the PID of the receiver, or 0 to allow nobody again
+ * @return true on success, or if there is no Yama to ask
+ */
+bool cmaAllow(pid_t recvPid)
+{
+	if (recvPid < 0 || (prctl(PR_SET_PTRACER, recvPid, 0, 0, 0) == -1 && errno != EINVAL)) {
+		fprintf(stderr, "failed to let the receiver read our memory: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Unmaps a file mapped by cmaMap, and withdraws the permission to read
+ * us in case the transfer ended before the receiver was done
+ * @param fileMap - the mapping
+ * @param size - the size of the file
+ */
+void cmaUnmap(void* fileMap, long size)
+{
+	prctl(PR_SET_PTRACER, 0, 0, 0, 0);
+	munmap(fileMap, size);
+}
+
+/**
+ * Pulls the file straight out of the sender's mapping into a mapping of
+ * the received file with process_vm_readv, CMA_IOV_COUNT ranges per call
+ * @param sendPid - the PID of the sender
+ * @param address - where the sender mapped the file
+ * @param size - the size of the file
+ * @param fd - the received file, open for reading and writing
+ * @param progress - called after every call, or NULL
+ * @return the bytes read, or -1 on failure
+ */
+long cmaRead(pid_t sendPid, unsigned long address, long size, int fd, progressFn progress)
+{
+	long total = 0;
+	ssize_t result = 0;
+
+	/* Size the received file up front and map it, so the kernel copies
+	   from the sender's page cache directly into ours */
+	void* fileMap = MAP_FAILED;
+	if (ftruncate(fd, size) == 0) {
+		fileMap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (fileMap == MAP_FAILED) {
+		fprintf(stderr, "failed to map file for received data: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Matching slices of the sender's mapping and ours */
+	struct iovec local[CMA_IOV_COUNT];
+	struct iovec remote[CMA_IOV_COUNT];
+
+	while (total < size)
+	{
+		int count = 0;
+		for (long offset = total; count < CMA_IOV_COUNT && offset < size; count++) {
+			size_t len = size - offset < CMA_IOV_SIZE ? size - offset : CMA_IOV_SIZE;
+			local[count].iov_base = (char*)fileMap + offset;
+			local[count].iov_len = len;
+			remote[count].iov_base = (void*)(address + offset);
+			remote[count].iov_len = len;
+			offset += len;
+		}
+
+		/* A short read stops at an iovec boundary and is resumed by the next batch */
+		if ((result = process_vm_readv(sendPid, local, count, remote, count, 0)) <= 0) {
+			fprintf(stderr, "failed to read sender memory: %s\n", result == 0 ? "no progress" : strerror(errno));
+			break;
+		}
+		total += result;
+		if (progress != NULL) {
+			progress(total, result);
+		}
+	}
+
+	munmap(fileMap, size);
+	return total == size ? total : -1;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include "dedup.h"
+
+/* Cut conditions, on the top bits of the gear hash since those depend
+   on the last 64 bytes: 15 bits before the average size, 11 after, so
+   chunk sizes bunch up around it */
+#define CDC_MASK_SMALL (((1ULL << 15) - 1) << 49)
+#define CDC_MASK_LARGE (((1ULL << 11) - 1) << 53)
+
+/**
+ * The gear table: a random value per byte, the same in every build so
+ * the same data is always cut in the same places
+ */
+
+struct gearTable
+{
+	unsigned long long values[256];
+
+	gearTable()
+	{
+		/* splitmix64 from a fixed seed */
+		unsigned long long state = 0x6970637866617374ULL;
+		for (int i = 0; i < 256; i++) {
+			unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			values[i] = z ^ (z >> 31);
+		}
+	}
+};
+
+static const gearTable gear;
+
+size_t cdcCut(const unsigned char* data, size_t size)
+{
+	if (size <= DEDUP_MIN_CHUNK) {
+		return size;
+	}
+	size_t end = size < DEDUP_MAX_CHUNK ? size : DEDUP_MAX_CHUNK;
+	size_t normal = end < DEDUP_AVG_CHUNK ? end : DEDUP_AVG_CHUNK;
+	unsigned long long hash = 0;
+
+	/* Nothing before the minimum can be a cut point, so skip hashing it */
+	size_t i = DEDUP_MIN_CHUNK;
+	for (; i < normal; i++) {
+		hash = (hash << 1) + gear.values[data[i]];
+		if ((hash & CDC_MASK_SMALL) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < end; i++) {
+		hash = (hash << 1) + gear.values[data[i]];
+		if ((hash & CDC_MASK_LARGE) == 0) {
+			return i + 1;
+		}
+	}
+	return end;
+}
+
+void chunkHash(const char* data, size_t size, chunkName& name)
+{
+	name.size = size;
+	SHA256((const unsigned char*)data, size, name.hash);
+}
+
+bool ChunkStore::open()
+{
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create chunk store %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+	usable = true;
+	return true;
+}
+
+void ChunkStore::chunkPath(const chunkName& name, char* path, size_t size)
+{
+	int length = snprintf(path, size, "%s/%02x/", dir, name.hash[0]);
+	for (int i = 1; i < DEDUP_HASH_SIZE && length + 2 < (int)size; i++) {
+		length += snprintf(path + length, size - length, "%02x", name.hash[i]);
+	}
+}
+
+bool ChunkStore::has(const chunkName& name)
+{
+	char path[4096];
+	struct stat statbuf;
+	if (!usable) {
+		return false;
+	}
+	chunkPath(name, path, sizeof(path));
+	return stat(path, &statbuf) == 0 && statbuf.st_size == name.size;
+}
+
+bool ChunkStore::load(const chunkName& name, char* buffer)
+{
+	char path[4096];
+	chunkPath(name, path, sizeof(path));
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	size_t done = 0;
+	ssize_t n = 0;
+	while (done < name.size && (n = read(fd, buffer + done, name.size - done)) > 0) {
+		done += n;
+	}
+	close(fd);
+	if (done != name.size) {
+		errno = n == 0 ? EIO : errno;
+		return false;
+	}
+
+	chunkName stored;
+	chunkHash(buffer, name.size, stored);
+	if (memcmp(stored.hash, name.hash, DEDUP_HASH_SIZE) != 0) {
+		fprintf(stderr, "removing damaged chunk %s\n", path);
+		unlink(path);
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+bool ChunkStore::save(const chunkName& name, const char* data)
+{
+	char path[4096], temp[4200];
+	if (!usable || has(name)) {
+		return usable;
+	}
+	chunkPath(name, path, sizeof(path));
+
+	/* The subdirectory for the first byte */
+	char* slash = strrchr(path, '/');
+	*slash = '\0';
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	*slash = '/';
+
+	snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+	int fd = ::open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "failed to store chunk %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	bool ok = write(fd, data, name.size) == (ssize_t)name.size;
+	ok = close(fd) == 0 && ok && rename(temp, path) == 0;
+	if (!ok) {
+		fprintf(stderr, "failed to store chunk %s: %s\n", path, strerror(errno));
+		unlink(temp);
+	}
+	return ok;
+}
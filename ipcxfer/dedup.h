@@ -0,0 +1,435 @@
+/* Deduplicating transfers (TRANSPORT_DEDUP). The sender cuts the file
+   into content-defined chunks (FastCDC), so an insertion only changes
+   the chunks around it, and names each chunk by its SHA-256. For every
+   batch of chunks it first sends the names; the receiver looks them up
+   in its chunk store, a directory that all its transfers share, and
+   answers which ones it lacks. Only those travel through the shared
+   memory slots; the rest are copied out of the store. */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include "transport.h"
+#include "flow.h"
+
+/* The chunk sizes: no cut before the minimum, a forced cut at the
+   maximum, and cut points picked to average about 8 KiB */
+#define DEDUP_MIN_CHUNK (2 << 10)
+#define DEDUP_AVG_CHUNK (8 << 10)
+#define DEDUP_MAX_CHUNK (64 << 10)
+
+/* The most chunks named in one batch. The receiver answers with a byte
+   per chunk, which must fit in a slot. */
+#define DEDUP_BATCH_CHUNKS 256
+
+/* How much of the file the sender reads ahead to cut into chunks */
+#define DEDUP_BUFFER_SIZE (4 << 20)
+
+/* The size of a chunk's name (SHA-256) */
+#define DEDUP_HASH_SIZE 32
+
+/* Where recv keeps its chunks unless told otherwise */
+#define DEDUP_STORE_DIR "chunkstore"
+
+/**
+ * A chunk as the sender names it
+ */
+
+struct chunkName
+{
+	/* Its size in bytes */
+	unsigned int size;
+
+	/* The SHA-256 of its contents */
+	unsigned char hash[DEDUP_HASH_SIZE];
+};
+
+/**
+ * Finds where the first chunk of some data ends (FastCDC with normalized
+ * chunking: a gear hash over the bytes, with a stricter cut condition
+ * before the average size and a looser one after it)
+ * @param data - the data
+ * @param size - its size
+ * @return the size of the first chunk; size itself if no cut point was
+ *         found before the end of the data and DEDUP_MAX_CHUNK
+ */
+size_t cdcCut(const unsigned char* data, size_t size);
+
+/**
+ * Names a chunk
+ * @param data - its contents
+ * @param size - its size
+ * @param name - where to store its size and hash
+ */
+void chunkHash(const char* data, size_t size, chunkName& name);
+
+/**
+ * The receiver's chunks, one file per chunk named after its hash, under
+ * a subdirectory for the first byte. New chunks are written to a
+ * temporary file and renamed into place, so receivers sharing the store
+ * never see half a chunk. A store that cannot be opened holds nothing
+ * and keeps nothing, so the transfer still works, just without dedup.
+ */
+
+class ChunkStore
+{
+public:
+	/**
+	 * @param dir - the directory
+	 */
+	explicit ChunkStore(const char* dir) : dir(dir), usable(false) {}
+
+	/**
+	 * Creates the directory if needed
+	 * @return true if the store can be used
+	 */
+	bool open();
+
+	/**
+	 * Tells whether a chunk is stored
+	 * @param name - the chunk
+	 */
+	bool has(const chunkName& name);
+
+	/**
+	 * Reads a stored chunk. One whose contents no longer match its name
+	 * (a damaged disk, a crash before the data reached it) is removed, so
+	 * the next transfer sends it again.
+	 * @param name - the chunk
+	 * @param buffer - where to store it, at least name.size bytes
+	 * @return true on success
+	 */
+	bool load(const chunkName& name, char* buffer);
+
+	/**
+	 * Stores a chunk, unless it is stored already. It is written to a
+	 * temporary file and renamed into place, so a partly written chunk is
+	 * never taken for a stored one.
+	 * @param name - the chunk, whose hash the caller has checked
+	 * @param data - its contents
+	 * @return true on success
+	 */
+	bool save(const chunkName& name, const char* data);
+
+private:
+	const char* dir;
+	bool usable;
+
+	/**
+	 * Builds the path of a chunk's file
+	 * @param name - the chunk
+	 * @param path - where to store it
+	 * @param size - the size of path
+	 */
+	void chunkPath(const chunkName& name, char* path, size_t size);
+};
+
+/**
+ * The shared memory slots, carrying for every batch the names of its
+ * chunks and then the chunks the receiver lacks. The receiver answers a
+ * batch in place: it writes a byte per chunk (1 if it lacks it) into the
+ * slot that held the end of the names before releasing that slot, and
+ * the sender reads them back once the release arrives. A batch of 0
+ * bytes ends the file.
+ */
+
+class DedupSegment
+{
+public:
+	static const bool DIRECT = true;
+
+	/**
+	 * @param sharedMemPtr - the slots of the attached segment
+	 * @param store - the receiver's chunk store (NULL on the sender side)
+	 */
+	DedupSegment(void* sharedMemPtr, ChunkStore* store = NULL)
+		: slots(sharedMemPtr, SHARED_MEMORY_CHUNK_SIZE, SHARED_MEMORY_SLOT_COUNT), store(store),
+		  seq(0), filled(0), avail(0), taken(0), sent(0) {}
+
+	/** The bytes of chunk data that went through the slots */
+	long sentBytes() const { return sent; }
+
+	template <class IO, class Notify>
+	long sendDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		std::vector<char> buffer(DEDUP_BUFFER_SIZE);
+		chunkName names[DEDUP_BATCH_CHUNKS];
+		size_t have = 0;
+		bool eof = false;
+		bool failed = false;
+		long total = 0;
+
+		for (;;)
+		{
+			/* Top up the read-ahead; a read error ends the file early and fails the transfer */
+			while (!eof && have < buffer.size()) {
+				ssize_t n = io.read(buffer.data() + have, buffer.size() - have);
+				if (n < 0) {
+					fprintf(stderr, "failed to read from file: %s\n", strerror(errno));
+					failed = true;
+				}
+				eof = n <= 0;
+				have += n > 0 ? n : 0;
+			}
+
+			/* Cut a batch, leaving a chunk that may go on past what we have read */
+			unsigned int count = 0;
+			size_t used = 0;
+			while (count < DEDUP_BATCH_CHUNKS && used < have) {
+				size_t size = cdcCut((const unsigned char*)buffer.data() + used, have - used);
+				if (!eof && size == have - used && size < DEDUP_MAX_CHUNK) {
+					break;
+				}
+				chunkHash(buffer.data() + used, size, names[count++]);
+				used += size;
+			}
+			if (count == 0) {
+				break;
+			}
+
+			/* Name the chunks, and learn which ones the receiver lacks */
+			if (!put(notify, (const char*)&count, sizeof(count)) ||
+				!put(notify, (const char*)names, count * sizeof(chunkName)) || !flush(notify) ||
+				!notify.waitAcked(seq - 1)) {
+				return -1;
+			}
+			unsigned char missing[DEDUP_BATCH_CHUNKS];
+			memcpy(missing, slots.slot(seq - 1), count);
+
+			/* Send those */
+			const char* chunk = buffer.data();
+			for (unsigned int i = 0; i < count; chunk += names[i++].size) {
+				if (missing[i] && !put(notify, chunk, names[i].size)) {
+					return -1;
+				}
+				sent += missing[i] ? names[i].size : 0;
+			}
+			if (!flush(notify)) {
+				return -1;
+			}
+
+			total += used;
+			if (progress != NULL) {
+				progress(total, used);
+			}
+			memmove(buffer.data(), buffer.data() + used, have - used);
+			have -= used;
+		}
+
+		/* The receiver releases the end marker once it has everything */
+		if (!notify.waitCredit(seq) || !notify.post(seq, 0) || !notify.waitAcked(seq)) {
+			return -1;
+		}
+		return failed ? -1 : total;
+	}
+
+	template <class IO, class Notify>
+	long recvDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		CreditWindow credit(slots.window());
+		std::vector<chunkName> names(DEDUP_BATCH_CHUNKS);
+		std::vector<char> chunk(DEDUP_MAX_CHUNK);
+		bool failed = false;
+		long total = 0;
+
+		for (;;)
+		{
+			/* A batch of 0 bytes ends the file */
+			unsigned int count;
+			int size = next(notify);
+			if (size < 0) {
+				return -1;
+			}
+			if (size == 0) {
+				release(notify, io, credit);
+				break;
+			}
+			if (!take(notify, io, credit, (char*)&count, sizeof(count)) || count > DEDUP_BATCH_CHUNKS ||
+				!take(notify, io, credit, (char*)names.data(), count * sizeof(chunkName), true)) {
+				fprintf(stderr, "The sender sent a bad batch of chunk names\n");
+				return -1;
+			}
+
+			/* Answer in the slot we still hold */
+			bool missing[DEDUP_BATCH_CHUNKS];
+			unsigned char* answer = (unsigned char*)slots.slot(seq);
+			for (unsigned int i = 0; i < count; i++) {
+				if (names[i].size == 0 || names[i].size > DEDUP_MAX_CHUNK) {
+					fprintf(stderr, "The sender named a chunk of %u bytes\n", names[i].size);
+					return -1;
+				}
+				missing[i] = !store->has(names[i]);
+				answer[i] = missing[i];
+			}
+			if (!release(notify, io, credit)) {
+				return -1;
+			}
+
+			/* Write the chunks out in order, from the slots or from the store */
+			long batch = 0;
+			for (unsigned int i = 0; i < count; i++) {
+				if (missing[i] && !take(notify, io, credit, chunk.data(), names[i].size)) {
+					return -1;
+				}
+				if (failed) {
+					continue;
+				}
+				/* The store is shared with later transfers: only keep a chunk
+				   that is what the sender says it is */
+				chunkName received;
+				if (missing[i]) {
+					chunkHash(chunk.data(), names[i].size, received);
+					if (memcmp(received.hash, names[i].hash, DEDUP_HASH_SIZE) != 0) {
+						fprintf(stderr, "The sender sent a chunk that does not match its name\n");
+						failed = true;
+						continue;
+					}
+					store->save(names[i], chunk.data());
+				} else if (!store->load(names[i], chunk.data())) {
+					fprintf(stderr, "failed to read a chunk from the store: %s\n", strerror(errno));
+					failed = true;
+					continue;
+				}
+				if (!io.write(chunk.data(), names[i].size)) {
+					fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
+					failed = true;
+				}
+				batch += names[i].size;
+			}
+
+			total += batch;
+			if (progress != NULL) {
+				progress(total, batch);
+			}
+		}
+		return failed ? -1 : total;
+	}
+
+private:
+	ShmSegment slots;
+	ChunkStore* store;
+
+	/* The slot being filled or drained */
+	unsigned int seq;
+
+	/* Sender: the bytes put in it so far */
+	size_t filled;
+
+	/* Receiver: the bytes it holds (0 before waiting for it) and the ones taken out */
+	size_t avail;
+	size_t taken;
+
+	/* Sender: the bytes of chunk data sent */
+	long sent;
+
+	/**
+	 * Appends to the stream going through the slots, announcing each
+	 * slot once full (sender)
+	 * @return true on success
+	 */
+	template <class Notify>
+	bool put(Notify& notify, const char* data, size_t size)
+	{
+		while (size > 0) {
+			if (filled == 0 && !notify.waitCredit(seq)) {
+				return false;
+			}
+			size_t n = size < slots.chunkSize() - filled ? size : slots.chunkSize() - filled;
+			memcpy(slots.slot(seq) + filled, data, n);
+			filled += n;
+			data += n;
+			size -= n;
+			if (filled == slots.chunkSize() && !flush(notify)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Announces the slot being filled, even if not full (sender)
+	 * @return true on success
+	 */
+	template <class Notify>
+	bool flush(Notify& notify)
+	{
+		if (filled == 0) {
+			return true;
+		}
+		if (!notify.post(seq, filled)) {
+			return false;
+		}
+		seq++;
+		filled = 0;
+		return true;
+	}
+
+	/**
+	 * Waits for the slot being drained to be announced (receiver)
+	 * @return the bytes in it, 0 at the end of the file, -1 on failure
+	 */
+	template <class Notify>
+	int next(Notify& notify)
+	{
+		if (avail == 0) {
+			int size = notify.waitPosted(seq);
+			if (size < 0) {
+				return -1;
+			}
+			if ((size_t)size > slots.chunkSize()) {
+				fprintf(stderr, "The sender announced a chunk of %d bytes\n", size);
+				return -1;
+			}
+			avail = size;
+			taken = 0;
+		}
+		return avail;
+	}
+
+	/**
+	 * Hands the slot being drained back, with credit (receiver)
+	 * @return true on success
+	 */
+	template <class IO, class Notify>
+	bool release(Notify& notify, IO& io, CreditWindow& credit)
+	{
+		credit.update(io.settle());
+		if (!notify.ack(seq, 0, credit.grant(seq + 1))) {
+			return false;
+		}
+		seq++;
+		avail = 0;
+		return true;
+	}
+
+	/**
+	 * Takes the next bytes of the stream out of the slots, releasing
+	 * each slot once drained (receiver)
+	 * @param hold - keep the slot holding the last byte, to answer in it
+	 * @return true on success; false if the sender died or ended the file first
+	 */
+	template <class IO, class Notify>
+	bool take(Notify& notify, IO& io, CreditWindow& credit, char* data, size_t size, bool hold = false)
+	{
+		while (size > 0) {
+			if (next(notify) <= 0) {
+				return false;
+			}
+			size_t n = size < avail - taken ? size : avail - taken;
+			memcpy(data, slots.slot(seq) + taken, n);
+			taken += n;
+			data += n;
+			size -= n;
+			if (taken == avail && !(hold && size == 0) && !release(notify, io, credit)) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,235 @@
+/* The transfer engine. Sender and Receiver are templated on a
+   transport, a notification and an I/O policy, so each combination the
+   front-ends use gets its own copy loop with every policy call inlined. */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "transport.h"
+#include "notify.h"
+#include "io.h"
+#include "flow.h"
+#include "trace.h"
+
+/**
+ * Sends one file
+ */
+
+template <class Transport, class Notify, class IO>
+class Sender
+{
+public:
+	/**
+	 * @param transport - where the chunks go
+	 * @param notify - how the receiver hears about them
+	 * @param io - the file to send
+	 * @param progress - called after every chunk, or NULL
+	 */
+	Sender(Transport& transport, Notify& notify, IO& io, progressFn progress = NULL)
+		: transport(transport), notify(notify), io(io), progress(progress) {}
+
+	/**
+	 * Sends the whole file and waits for the receiver to finish with it
+	 * @return the bytes sent, -1 on failure, or XFER_FALLBACK if the
+	 *         receiver asked for shared memory instead
+	 */
+	long run()
+	{
+		if constexpr (Transport::DIRECT) {
+			return transport.sendDirect(io, notify, progress);
+		} else {
+			return copyLoop();
+		}
+	}
+
+private:
+	Transport& transport;
+	Notify& notify;
+	IO& io;
+	progressFn progress;
+
+	/**
+	 * Reads the file into slots and announces each one, reading ahead
+	 * only as far as the receiver's credit allows. A chunk of 0 bytes
+	 * ends the file.
+	 */
+	long copyLoop()
+	{
+		long total = 0;
+		unsigned int seq = 0;
+		bool failed = false;
+		ssize_t size;
+		off_t hole = 0;
+
+		do
+		{
+			/* Wait for the receiver to grant the slot */
+			TRACE(TRACE_CREDIT_WAIT_BEGIN, seq, 0);
+			if (!notify.waitCredit(seq)) {
+				return -1;
+			}
+			TRACE(TRACE_CREDIT_WAIT_END, seq, 0);
+
+			/* A read error ends the file early and fails the transfer */
+			if ((size = readChunk(transport.slot(seq), hole)) < 0) {
+				fprintf(stderr, "failed to read from file: %s\n", strerror(errno));
+				failed = true;
+				size = 0;
+				hole = 0;
+			}
+			TRACE(TRACE_SLOT_FILLED, seq, size);
+			if (!notify.post(seq, size, hole)) {
+				return -1;
+			}
+			TRACE(TRACE_NOTIFY_SENT, seq, size);
+
+			total += size + hole;
+			if (progress != NULL && size + hole > 0) {
+				progress(total, size + hole);
+			}
+			seq++;
+		} while (size > 0 || hole > 0);
+
+		/* The receiver releases the end marker once it has everything */
+		TRACE(TRACE_ACK_WAIT_BEGIN, seq - 1, 0);
+		if (!notify.waitAcked(seq - 1)) {
+			return -1;
+		}
+		TRACE(TRACE_ACK_WAIT_END, seq - 1, 0);
+		return failed ? -1 : total;
+	}
+
+	/**
+	 * Reads the next chunk into a slot. Where the notification can carry
+	 * holes, the holes of a sparse file are skipped without being read,
+	 * and chunks that turn out to be all zeros are not sent either: both
+	 * become the hole before the chunk, and the slot holds what follows.
+	 * @param slot - the slot
+	 * @param hole - set to the bytes of zeros before the chunk
+	 * @return the bytes in the slot, 0 at the end of the file, -1 on failure
+	 */
+	ssize_t readChunk(char* slot, off_t& hole)
+	{
+		hole = 0;
+		ssize_t size;
+		if constexpr (Notify::HOLES) {
+			do {
+				hole += io.hole(SPARSE_HOLE_MAX - hole);
+				size = io.read(slot, transport.chunkSize());
+				if (size <= 0 || !isZeroBlock(slot, size)) {
+					break;
+				}
+				hole += size;
+				size = 0;
+			} while (hole + transport.chunkSize() <= SPARSE_HOLE_MAX);
+		} else {
+			size = io.read(slot, transport.chunkSize());
+		}
+		return size;
+	}
+};
+
+/**
+ * Receives one file
+ */
+
+template <class Transport, class Notify, class IO>
+class Receiver
+{
+public:
+	/**
+	 * @param transport - where the chunks come from
+	 * @param notify - how we hear about them
+	 * @param io - the file to write
+	 * @param progress - called after every chunk, or NULL
+	 */
+	Receiver(Transport& transport, Notify& notify, IO& io, progressFn progress = NULL)
+		: transport(transport), notify(notify), io(io), progress(progress) {}
+
+	/**
+	 * Receives the whole file
+	 * @return the bytes received, -1 on failure, or XFER_FALLBACK if the
+	 *         file will come through shared memory instead
+	 */
+	long run()
+	{
+		if constexpr (Transport::DIRECT) {
+			return transport.recvDirect(io, notify, progress);
+		} else {
+			return copyLoop();
+		}
+	}
+
+private:
+	Transport& transport;
+	Notify& notify;
+	IO& io;
+	progressFn progress;
+
+	/**
+	 * Writes out each chunk as it is announced and releases its slot,
+	 * granting credit by how well write-back keeps up (see CreditWindow).
+	 * After a write error it keeps releasing slots, so the sender (and
+	 * other receivers of a broadcast) are not held back.
+	 */
+	long copyLoop()
+	{
+		CreditWindow credit(transport.window());
+		long total = 0;
+		bool failed = false;
+
+		for (unsigned int seq = 0;; seq++)
+		{
+			TRACE(TRACE_POST_WAIT_BEGIN, seq, 0);
+			long hole = 0;
+			int size = notify.waitPosted(seq, &hole);
+			if (size < 0) {
+				return -1;
+			}
+			/* The size comes from shared memory: never write past the slot */
+			if ((size_t)size > transport.chunkSize() || hole < 0) {
+				fprintf(stderr, "The sender announced a chunk of %d bytes after %ld zeros\n", size, hole);
+				return -1;
+			}
+			TRACE(TRACE_POST_WAIT_END, seq, size);
+
+			/* The zeros before the chunk become a hole in our file */
+			TRACE(TRACE_WRITE_BEGIN, seq, size);
+			if (hole > 0 && !failed && !io.skip(hole)) {
+				fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
+				failed = true;
+			}
+			if (size > 0 && !failed && !io.write(transport.slot(seq), size)) {
+				fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
+				failed = true;
+			}
+			TRACE(TRACE_WRITE_END, seq, size);
+
+			long stallNs = io.settle();
+			if (stallNs >= 0) {
+				TRACE(TRACE_WRITEBACK, seq, stallNs);
+			}
+			credit.update(stallNs);
+
+			unsigned int granted = credit.grant(seq + 1);
+			if (!notify.ack(seq, 0, granted)) {
+				return -1;
+			}
+			TRACE(TRACE_ACK_SENT, seq, granted);
+			if (size == 0 && hole == 0) {
+				break;
+			}
+
+			total += size + hole;
+			if (progress != NULL) {
+				progress(total, size + hole);
+			}
+		}
+		return failed ? -1 : total;
+	}
+};
+
+#endif
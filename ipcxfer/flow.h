@@ -0,0 +1,67 @@
+/* Credit-based flow control. The receiver grants the sender credit to
+   fill slots: chunk n may only be filled once the receiver has granted a
+   credit above n. Credits are cumulative and never taken back, and are
+   never more than a window ahead of the chunks the receiver has
+   released, so a slot the sender has credit for is always free. */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+/* The credit a sender starts with, before it hears from the receiver */
+#define XFER_INITIAL_CREDIT 1
+
+/* Waiting this long for write-back in one step counts as a stalled disk */
+#define XFER_STALL_NS 1000000
+
+/**
+ * The receiver's side: how far ahead the sender may read
+ */
+
+class CreditWindow
+{
+public:
+	/**
+	 * @param window - the most chunks the transport can have in flight
+	 */
+	explicit CreditWindow(unsigned int window) : window(window), size(window), limit(XFER_INITIAL_CREDIT) {}
+
+	/**
+	 * Adapts the window to the receiver's write-back progress. It halves
+	 * when a write-back step stalled, so a slow disk holds the sender
+	 * back, and grows by a chunk after each step that did not, so a fast
+	 * disk gets the whole window again.
+	 * @param stallNs - what IO::settle() returned for the last chunk
+	 */
+	void update(long stallNs)
+	{
+		if (stallNs >= XFER_STALL_NS) {
+			size = size > 1 ? size / 2 : 1;
+		} else if (stallNs >= 0 && size < window) {
+			size++;
+		}
+	}
+
+	/**
+	 * Works out the credit to grant along with a release
+	 * @param released - how many chunks the receiver has released
+	 * @return the credit, never lower than one granted before
+	 */
+	unsigned int grant(unsigned int released)
+	{
+		unsigned int next = released + size;
+		if ((int)(next - limit) > 0) {
+			limit = next;
+		}
+		return limit;
+	}
+
+	/** The current window, in chunks */
+	unsigned int chunks() const { return size; }
+
+private:
+	unsigned int window;
+	unsigned int size;
+	unsigned int limit;
+};
+
+#endif
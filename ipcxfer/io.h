@@ -0,0 +1,414 @@
+/* I/O policies: how the engine reads the file it sends and writes the
+   file it receives */
+
+#ifndef IO_H
+#define IO_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Bytes a receiver writes before it starts write-back on them */
+#define WRITEBEHIND_STEP (1 << 20)
+
+/* The most written bytes a receiver lets sit dirty in the page cache */
+#define WRITEBEHIND_LIMIT (8 << 20)
+
+/* The longest hole one chunk announces */
+#define SPARSE_HOLE_MAX (1L << 30)
+
+/**
+ * Tells whether a buffer holds only zeros, 64 bytes at a time. Data
+ * that is not zero almost always fails on the first block, so checking
+ * every chunk costs next to nothing.
+ * @param buffer - the data
+ * @param size - its size
+ */
+
+inline bool isZeroBlock(const char* buffer, size_t size)
+{
+	size_t done = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; done + 64 <= size; done += 64) {
+		const __m128i* block = (const __m128i*)(buffer + done);
+		__m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+			_mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+	for (; done < size; done++) {
+		if (buffer[done] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Finds the holes of a file read front to back with SEEK_DATA and
+ * SEEK_HOLE, asking the file system only once per data region. Gives
+ * up quietly on files that cannot tell (pipes, some file systems just
+ * report no holes).
+ */
+
+class HoleFinder
+{
+public:
+	HoleFinder() : dataStart(0), dataEnd(0), enabled(true) {}
+
+	/**
+	 * Measures the hole at a position
+	 * @param fd - the file; its offset is left anywhere
+	 * @param pos - the position
+	 * @param most - the longest hole to report
+	 * @param probed - set to true if the offset of fd was moved
+	 * @return the bytes of hole from pos on, at most most
+	 */
+	off_t find(int fd, off_t pos, off_t most, bool& probed)
+	{
+		if (enabled && pos >= dataEnd) {
+			probed = true;
+			dataStart = lseek(fd, pos, SEEK_DATA);
+			if (dataStart == -1 && errno == ENXIO) {
+				/* Nothing but hole up to the end of the file */
+				struct stat statbuf;
+				dataStart = dataEnd = fstat(fd, &statbuf) == -1 ? pos : statbuf.st_size;
+			} else if (dataStart == -1 || (dataEnd = lseek(fd, dataStart, SEEK_HOLE)) == -1) {
+				enabled = false;
+			}
+		}
+		if (!enabled || pos >= dataStart) {
+			return 0;
+		}
+		return dataStart - pos < most ? dataStart - pos : most;
+	}
+
+private:
+	/* The data region after the position last asked about */
+	off_t dataStart;
+	off_t dataEnd;
+	bool enabled;
+};
+
+/**
+ * Leaves a hole in a file being written instead of writing zeros: past
+ * the end of the file it grows the file with ftruncate, before the end
+ * it frees the range with fallocate(PUNCH_HOLE)
+ * @param fd - the file
+ * @param pos - where the hole starts
+ * @param size - its length
+ * @return true on success; false if the file cannot have holes
+ */
+
+inline bool punchHole(int fd, off_t pos, off_t size)
+{
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+		return false;
+	}
+	if (pos < statbuf.st_size) {
+		off_t inside = statbuf.st_size - pos < size ? statbuf.st_size - pos : size;
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, inside) == -1) {
+			return false;
+		}
+	}
+	return pos + size <= statbuf.st_size || ftruncate(fd, pos + size) == 0;
+}
+
+/**
+ * Keeps the dirty pages of a file written front to back bounded: every
+ * WRITEBEHIND_STEP bytes it starts write-back of what was written, and
+ * waits for anything older than WRITEBEHIND_LIMIT to reach the disk.
+ * Gives up quietly on files that cannot be synced by range (pipes).
+ */
+
+class WriteBehind
+{
+public:
+	WriteBehind() : written(0), submitted(0), settled(0), enabled(true) {}
+
+	/** Counts bytes just written */
+	void wrote(size_t size) { written += size; }
+
+	/** Whether a step is due, so the caller can flush its buffers first */
+	bool due() const { return enabled && written - submitted >= WRITEBEHIND_STEP; }
+
+	/**
+	 * Takes a write-back step if one is due
+	 * @param fd - the file
+	 * @return the nanoseconds spent waiting for the disk, or -1 if no
+	 *         step was taken
+	 */
+	long step(int fd)
+	{
+		if (!due()) {
+			return -1;
+		}
+		if (sync_file_range(fd, submitted, written - submitted, SYNC_FILE_RANGE_WRITE) == -1) {
+			enabled = false;
+			return -1;
+		}
+		submitted = written;
+		if (written - settled <= WRITEBEHIND_LIMIT) {
+			return 0;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		off_t target = written - WRITEBEHIND_LIMIT;
+		if (sync_file_range(fd, settled, target - settled,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+			enabled = false;
+			return -1;
+		}
+		settled = target;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+	}
+
+private:
+	off_t written;
+	off_t submitted;
+	off_t settled;
+	bool enabled;
+};
+
+/**
+ * Buffered stdio, as send and recv always used
+ */
+
+class StdioIO
+{
+public:
+	/**
+	 * @param fp - the open file
+	 */
+	explicit StdioIO(FILE* fp) : fp(fp), offset(-1) {}
+
+	/**
+	 * Reads the next piece of the file
+	 * @param buffer - where to store it
+	 * @param size - the most bytes to read
+	 * @return the bytes read, 0 at the end of the file, -1 on failure
+	 */
+	ssize_t read(char* buffer, size_t size)
+	{
+		size_t result = fread(buffer, sizeof(char), size, fp);
+		offset += offset == -1 ? 0 : result;
+		return result == 0 && ferror(fp) ? -1 : (ssize_t)result;
+	}
+
+	/**
+	 * Skips the hole the file is at, if any, so it is never read
+	 * @param most - the longest hole to skip
+	 * @return the bytes skipped
+	 */
+	off_t hole(off_t most)
+	{
+		if (offset == -1) {
+			offset = ftello(fp);
+		}
+		bool probed = false;
+		off_t skipped = offset == -1 ? 0 : holes.find(fileno(fp), offset, most, probed);
+		/* Moving the descriptor under the stream means seeking the stream
+		   back, which also drops its buffer, so only then */
+		if ((probed || skipped > 0) && fseeko(fp, offset + skipped, SEEK_SET) == -1) {
+			return 0;
+		}
+		offset += skipped;
+		return skipped;
+	}
+
+	/**
+	 * Writes a piece of the file
+	 * @param buffer - the data
+	 * @param size - the number of bytes
+	 * @return true on success
+	 */
+	bool write(const char* buffer, size_t size)
+	{
+		behind.wrote(size);
+		return fwrite(buffer, sizeof(char), size, fp) == size;
+	}
+
+	/**
+	 * Writes a hole: zeros that take no disk space where the file allows it
+	 * @param size - the number of bytes
+	 * @return true on success
+	 */
+	bool skip(off_t size)
+	{
+		off_t pos = fflush(fp) == 0 ? ftello(fp) : -1;
+		if (pos != -1 && punchHole(fileno(fp), pos, size)) {
+			behind.wrote(size);
+			return fseeko(fp, pos + size, SEEK_SET) == 0;
+		}
+		static const char zeros[65536] = {};
+		for (off_t n; size > 0; size -= n) {
+			n = size < (off_t)sizeof(zeros) ? size : (off_t)sizeof(zeros);
+			if (!write(zeros, n)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Bounds the written data still waiting for the disk (see WriteBehind)
+	 * @return the nanoseconds spent waiting, or -1 if no step was taken
+	 */
+	long settle()
+	{
+		if (!behind.due() || fflush(fp) != 0) {
+			return -1;
+		}
+		return behind.step(fileno(fp));
+	}
+
+	/**
+	 * The descriptor under the stream, for transports that bypass stdio
+	 */
+	int fd()
+	{
+		fflush(fp);
+		return fileno(fp);
+	}
+
+private:
+	FILE* fp;
+	WriteBehind behind;
+
+	/* Where reading is up to, or -1 if not known yet */
+	off_t offset;
+	HoleFinder holes;
+};
+
+/**
+ * Unbuffered read/write on a descriptor
+ */
+
+class FdIO
+{
+public:
+	/**
+	 * @param fd - the open file
+	 */
+	explicit FdIO(int fd) : desc(fd), offset(-1) {}
+
+	/**
+	 * Reads the next piece of the file, filling the buffer unless the file ends
+	 * @param buffer - where to store it
+	 * @param size - the most bytes to read
+	 * @return the bytes read, 0 at the end of the file, -1 on failure
+	 */
+	ssize_t read(char* buffer, size_t size)
+	{
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = ::read(desc, buffer + done, size - done);
+			if (n == -1) {
+				return -1;
+			}
+			if (n == 0) {
+				break;
+			}
+			done += n;
+		}
+		offset += offset == -1 ? 0 : done;
+		return done;
+	}
+
+	/**
+	 * Skips the hole the file is at, if any, so it is never read
+	 * @param most - the longest hole to skip
+	 * @return the bytes skipped
+	 */
+	off_t hole(off_t most)
+	{
+		if (offset == -1) {
+			offset = lseek(desc, 0, SEEK_CUR);
+		}
+		bool probed = false;
+		off_t skipped = offset == -1 ? 0 : holes.find(desc, offset, most, probed);
+		if ((probed || skipped > 0) && lseek(desc, offset + skipped, SEEK_SET) == -1) {
+			return 0;
+		}
+		offset += skipped;
+		return skipped;
+	}
+
+	/**
+	 * Writes a piece of the file, resuming after short writes
+	 * @param buffer - the data
+	 * @param size - the number of bytes
+	 * @return true on success
+	 */
+	bool write(const char* buffer, size_t size)
+	{
+		behind.wrote(size);
+		for (ssize_t n; size > 0; buffer += n, size -= n) {
+			if ((n = ::write(desc, buffer, size)) == -1) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Writes a hole: zeros that take no disk space where the file allows it
+	 * @param size - the number of bytes
+	 * @return true on success
+	 */
+	bool skip(off_t size)
+	{
+		off_t pos = lseek(desc, 0, SEEK_CUR);
+		if (pos != -1 && punchHole(desc, pos, size)) {
+			behind.wrote(size);
+			return lseek(desc, pos + size, SEEK_SET) != -1;
+		}
+		static const char zeros[65536] = {};
+		for (off_t n; size > 0; size -= n) {
+			n = size < (off_t)sizeof(zeros) ? size : (off_t)sizeof(zeros);
+			if (!write(zeros, n)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Bounds the written data still waiting for the disk (see WriteBehind)
+	 * @return the nanoseconds spent waiting, or -1 if no step was taken
+	 */
+	long settle()
+	{
+		return behind.step(desc);
+	}
+
+	/**
+	 * The descriptor
+	 */
+	int fd()
+	{
+		return desc;
+	}
+
+private:
+	int desc;
+	WriteBehind behind;
+
+	/* Where reading is up to, or -1 if not known yet */
+	off_t offset;
+	HoleFinder holes;
+};
+
+#endif
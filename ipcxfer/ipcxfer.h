@@ -0,0 +1,36 @@
+/* libipcxfer: file transfers between processes on one host.
+ *
+ * channel.h   sets up the System V objects the processes share
+ * engine.h    Sender and Receiver, templated on the policies below
+ * transport.h where the chunks travel: ShmSegment, RingSegment,
+ *             SpliceFifo, CmaMapping
+ * dedup.h     DedupSegment, content-defined chunks and the chunk store
+ * seal.h      SealedIO, AES-GCM encryption of every chunk
+ * socket.h    SocketStream, the file over a UNIX domain or TCP socket
+ * notify.h    how the peers signal each other: QueueNotify,
+ *             SignalNotify, FutexNotify
+ * io.h        how the file is read and written: StdioIO, FdIO
+ * wait.h      wait strategies used by the notification policies
+ * watch.h     owner records and the thread that notices dead peers
+ * trace.h     recording the protocol's events for tracejson
+ * affinity.h  CPU pinning and NUMA placement
+ * msgring.h   the small-message API
+ * async.h     coroutine API for event-loop based services (C++20)
+ */
+
+#ifndef IPCXFER_H
+#define IPCXFER_H
+
+#include "msg.h"
+#include "channel.h"
+#include "engine.h"
+#include "dedup.h"
+#include "seal.h"
+#include "socket.h"
+#include "affinity.h"
+#include "msgring.h"
+#if __cplusplus >= 202002L
+#include "async.h"
+#endif
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef MSG_H
+#define MSG_H
+
+#include <stdio.h>
+
+/* The information type */ 
+
+#define SENDER_DATA_TYPE 1
+
+/* The done message */
+#define RECV_DONE_TYPE 2
+
+/* The size a process posts to itself when its peer has died, to end its wait */
+#define PEER_GONE_SIZE -3
+
+/* The size of the shared memory chunk */
+#define SHARED_MEMORY_CHUNK_SIZE 1000
+
+/* The number of chunks the shared memory segment holds, so several can be in flight */
+#define SHARED_MEMORY_SLOT_COUNT 8
+
+/* The size of the shared memory segment */
+#define SHARED_MEMORY_SIZE (SHARED_MEMORY_CHUNK_SIZE * SHARED_MEMORY_SLOT_COUNT)
+
+/* The setup message sent once before any data */
+#define SENDER_HELLO_TYPE 3
+
+/* The transports the sender can announce in the setup message */
+#define TRANSPORT_SHM 0
+#define TRANSPORT_SPLICE 1
+#define TRANSPORT_CMA 2
+#define TRANSPORT_BCAST 3
+#define TRANSPORT_DEDUP 4
+
+/* The FIFO the splice transport moves pages through */
+#define SPLICE_FIFO_NAME "ipcfifo"
+
+/* The most bytes moved by a single splice call (also the requested pipe size) */
+#define SPLICE_CHUNK_SIZE (1 << 20)
+
+/* The bytes each process_vm_readv iovec covers */
+#define CMA_IOV_SIZE (256 << 10)
+
+/* The iovecs batched into a single process_vm_readv call */
+#define CMA_IOV_COUNT 64
+
+/* The random part of the nonces of an encrypted transfer (see seal.h) */
+#define SEAL_SALT_SIZE 8
+
+/**
+ * The message structure
+ */
+
+
+struct message
+{
+	/* The message type */
+	long mtype;
+	
+	/* How many bytes in the message */
+	int size;
+
+	/* RECV_DONE_TYPE only: the sender may fill chunks numbered below this */
+	unsigned int credit;
+
+	/* SENDER_DATA_TYPE only: the bytes of zeros that come before the chunk */
+	long hole;
+	
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %d %u %ld", mtype, size, credit, hole);
+	}
+};
+
+/**
+ * The setup message telling the receiver how the file will arrive
+ */
+
+struct hello
+{
+	/* The message type */
+	long mtype;
+
+	/* One of the TRANSPORT_ values */
+	int transport;
+
+	/* The size of the file in bytes (0 when the sender reads from a pipe) */
+	long fileSize;
+
+	/* Where the sender mapped the file (TRANSPORT_CMA only) */
+	unsigned long address;
+
+	/* The slot ring segment and this receiver's cursor in it (TRANSPORT_BCAST only) */
+	int ringId;
+	int reader;
+
+	/* Whether the chunks are encrypted, and the salt of their nonces */
+	int sealed;
+	unsigned char salt[SEAL_SALT_SIZE];
+
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %d %ld %lx %d %d %d", mtype, transport, fileSize, address, ringId, reader, sealed);
+	}
+};
+
+/* The size of a message body as msgsnd/msgrcv count it (everything after mtype) */
+#define MSG_BODY_SIZE(msg) (sizeof(msg) - sizeof(long))
+
+#endif
@@ -0,0 +1,225 @@
+/* Small messages between two processes, with the payload inlined in
+   cache-line slots so a message and its "ready" flag arrive together */
+
+#ifndef MSGRING_H
+#define MSGRING_H
+
+#include <errno.h>
+#include <string.h>
+#include "wait.h"
+
+/* The size of a slot: one cache line */
+#define MSGRING_SLOT_SIZE 64
+
+/* The number of slots in each direction */
+#define MSGRING_SLOT_COUNT 1024
+
+/* Payloads up to this size fit in a single slot */
+#define MSGRING_INLINE_SIZE (MSGRING_SLOT_SIZE - 2 * sizeof(unsigned int))
+
+/* The largest payload; past MSGRING_INLINE_SIZE it continues in the following slots */
+#define MSGRING_MAX_SIZE 4096
+
+/* The size of a run of slots that only skips to the start of the ring */
+#define MSGRING_PADDING 0xffffffffu
+
+/**
+ * A slot. Every slot a message covers carries its own ring position
+ * plus one in seq, so leftovers from an earlier lap are never mistaken
+ * for the message the consumer is waiting on.
+ */
+
+struct msgSlot
+{
+	/* The ring position of the slot plus one, once it is published */
+	unsigned int seq;
+
+	/* The payload size (first slot of a message only), or MSGRING_PADDING */
+	unsigned int size;
+
+	/* The payload, or the next MSGRING_INLINE_SIZE bytes of it */
+	char data[MSGRING_INLINE_SIZE];
+} __attribute__((aligned(MSGRING_SLOT_SIZE)));
+
+/**
+ * One direction of the channel, with a single producer and consumer
+ */
+
+struct msgRing
+{
+	/* How many slots the consumer has finished with */
+	unsigned int tail __attribute__((aligned(MSGRING_SLOT_SIZE)));
+
+	/* Set while the consumer or producer sleeps, so the other side
+	   only makes a system call when someone needs waking */
+	unsigned int consumerSleeping __attribute__((aligned(MSGRING_SLOT_SIZE)));
+	unsigned int producerSleeping;
+
+	/* The messages */
+	msgSlot slots[MSGRING_SLOT_COUNT];
+};
+
+/**
+ * The shared segment: requests from the client, responses from the server
+ */
+
+struct msgPair
+{
+	msgRing requests;
+	msgRing responses;
+};
+
+/**
+ * One process's end of the channel
+ */
+
+struct msgEndpoint
+{
+	/* The ring we send on and the ring we receive from */
+	msgRing* out;
+	msgRing* in;
+
+	/* Our position in each */
+	unsigned int sendPos;
+	unsigned int recvPos;
+
+	/* The consumer's tail of the out ring as we last read it */
+	unsigned int cachedTail;
+
+	/* How to wait for the peer */
+	waitStrategy wait;
+};
+
+/**
+ * Sets up one end of an attached channel
+ * @param ep - the endpoint
+ * @param pair - the channel
+ * @param isServer - true to receive requests and send responses
+ * @param strategy - the WAIT_ value to wait for the peer with
+ */
+
+inline void msgEndpointInit(msgEndpoint& ep, msgPair* pair, bool isServer, int strategy)
+{
+	ep.out = isServer ? &pair->responses : &pair->requests;
+	ep.in = isServer ? &pair->requests : &pair->responses;
+	ep.sendPos = 0;
+	ep.recvPos = 0;
+	ep.cachedTail = 0;
+	ep.wait.kind = strategy;
+	ep.wait.budget = SPIN_MIN_BUDGET;
+}
+
+/**
+ * The number of slots a payload covers
+ * @param size - the payload size
+ */
+
+inline unsigned int msgSlotsFor(unsigned int size)
+{
+	return size <= MSGRING_INLINE_SIZE ? 1 : (size + MSGRING_INLINE_SIZE - 1) / MSGRING_INLINE_SIZE;
+}
+
+/**
+ * Sends a message, waiting for room if the peer is behind
+ * @param ep - our endpoint
+ * @param data - the payload
+ * @param size - the payload size, at most MSGRING_MAX_SIZE
+ * @return 0 on success, -1 with errno EMSGSIZE if the payload is too big
+ */
+
+inline int msgRingSend(msgEndpoint& ep, const void* data, unsigned int size)
+{
+	if (size > MSGRING_MAX_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	unsigned int count = msgSlotsFor(size);
+	unsigned int index = ep.sendPos % MSGRING_SLOT_COUNT;
+
+	/* A message never wraps around the ring: skip to the start instead */
+	unsigned int padding = index + count > MSGRING_SLOT_COUNT ? MSGRING_SLOT_COUNT - index : 0;
+
+	/* Only look at the consumer's tail when the one we know is not enough */
+	while (ep.sendPos + padding + count - ep.cachedTail > MSGRING_SLOT_COUNT) {
+		unsigned int tail = __atomic_load_n(&ep.out->tail, __ATOMIC_ACQUIRE);
+		if (tail == ep.cachedTail) {
+			tail = waitChange(ep.wait, &ep.out->tail, tail, &ep.out->producerSleeping);
+		}
+		ep.cachedTail = tail;
+	}
+
+	msgSlot* slot;
+	if (padding > 0) {
+		slot = &ep.out->slots[index];
+		slot->size = MSGRING_PADDING;
+		__atomic_store_n(&slot->seq, ep.sendPos + 1, __ATOMIC_RELEASE);
+		futexWakeSleepers(&slot->seq, &ep.out->consumerSleeping);
+		ep.sendPos += padding;
+		index = 0;
+	}
+
+	/* Fill the continuation slots first, then publish the first one */
+	const char* payload = (const char*)data;
+	for (unsigned int i = 1; i < count; i++) {
+		unsigned int offset = i * MSGRING_INLINE_SIZE;
+		unsigned int len = size - offset < MSGRING_INLINE_SIZE ? size - offset : MSGRING_INLINE_SIZE;
+		ep.out->slots[index + i].seq = ep.sendPos + i + 1;
+		memcpy(ep.out->slots[index + i].data, payload + offset, len);
+	}
+	slot = &ep.out->slots[index];
+	slot->size = size;
+	memcpy(slot->data, payload, size < MSGRING_INLINE_SIZE ? size : MSGRING_INLINE_SIZE);
+	__atomic_store_n(&slot->seq, ep.sendPos + 1, __ATOMIC_RELEASE);
+	futexWakeSleepers(&slot->seq, &ep.out->consumerSleeping);
+	ep.sendPos += count;
+	return 0;
+}
+
+/**
+ * Receives the next message, waiting for one if there is none
+ * @param ep - our endpoint
+ * @param data - where to store the payload
+ * @param capacity - the size of data
+ * @return the payload size, or -1 with errno EMSGSIZE if the payload
+ *         did not fit (it is dropped)
+ */
+
+inline int msgRingRecv(msgEndpoint& ep, void* data, unsigned int capacity)
+{
+	for (;;)
+	{
+		unsigned int index = ep.recvPos % MSGRING_SLOT_COUNT;
+		msgSlot* slot = &ep.in->slots[index];
+		unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		while (seq != ep.recvPos + 1) {
+			seq = waitChange(ep.wait, &slot->seq, seq, &ep.in->consumerSleeping);
+		}
+
+		unsigned int size = slot->size;
+		unsigned int count = size == MSGRING_PADDING ? MSGRING_SLOT_COUNT - index : msgSlotsFor(size);
+		if (size != MSGRING_PADDING && size <= capacity) {
+			char* payload = (char*)data;
+			for (unsigned int i = 0; i < count; i++) {
+				unsigned int offset = i * MSGRING_INLINE_SIZE;
+				unsigned int len = size - offset < MSGRING_INLINE_SIZE ? size - offset : MSGRING_INLINE_SIZE;
+				memcpy(payload + offset, ep.in->slots[index + i].data, len);
+			}
+		}
+
+		/* Hand the slots back */
+		ep.recvPos += count;
+		__atomic_store_n(&ep.in->tail, ep.recvPos, __ATOMIC_RELEASE);
+		futexWakeSleepers(&ep.in->tail, &ep.in->producerSleeping);
+
+		if (size == MSGRING_PADDING) {
+			continue;
+		}
+		if (size > capacity) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		return size;
+	}
+}
+
+#endif
@@ -0,0 +1,517 @@
+/* Notification policies: how the sender tells the receiver a chunk is
+   ready, and how the receiver tells the sender it is done with it and
+   how far ahead it may fill slots (see flow.h). Chunks are numbered
+   from 0; chunk n + 1 follows chunk n. */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/msg.h>
+#include "msg.h"
+#include "ring.h"
+#include "wait.h"
+#include "flow.h"
+
+/**
+ * Messages on a System V queue: SENDER_DATA_TYPE carries the size of a
+ * chunk and the hole before it, RECV_DONE_TYPE releases one and carries
+ * the receiver's credit. A message of PEER_GONE_SIZE (see interrupt())
+ * fails the wait.
+ */
+
+class QueueNotify
+{
+public:
+	/* A chunk can announce a hole */
+	static const bool HOLES = true;
+
+	/**
+	 * @param msqid - the message queue
+	 * @param strategy - how to wait for the peer
+	 */
+	QueueNotify(int msqid, waitStrategy& strategy) : msqid(msqid), strategy(strategy), acked(0), credit(XFER_INITIAL_CREDIT) {}
+
+	/**
+	 * Announces a chunk (sender)
+	 * @param seq - the chunk number
+	 * @param size - the bytes in it; 0 with no hole marks the end of the file
+	 * @param hole - the bytes of zeros before them, sent as a length only
+	 * @return true on success
+	 */
+	bool post(unsigned int seq, int size, long hole = 0)
+	{
+		message msg;
+		msg.mtype = SENDER_DATA_TYPE;
+		msg.size = size;
+		msg.credit = 0;
+		msg.hole = hole;
+		if (msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0) == -1) {
+			fprintf(stderr, "failed to send message to receiver: %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Waits until the receiver has released a chunk and all before it (sender)
+	 * @param seq - the chunk number
+	 * @param status - if not NULL, set to the status the receiver sent with its last release
+	 * @return true on success
+	 */
+	bool waitAcked(unsigned int seq, int* status = NULL)
+	{
+		message msg;
+		msg.size = 0;
+		while ((int)(acked - seq) <= 0) {
+			if (!receiveAck(msg)) {
+				return false;
+			}
+		}
+		if (status != NULL) {
+			*status = msg.size;
+		}
+		return true;
+	}
+
+	/**
+	 * Waits until the receiver has granted credit to fill a chunk (sender)
+	 * @param seq - the chunk number
+	 * @return true on success
+	 */
+	bool waitCredit(unsigned int seq)
+	{
+		message msg;
+		while ((int)(credit - seq) <= 0) {
+			if (!receiveAck(msg)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Waits for the sender to announce a chunk (receiver)
+	 * @param seq - the chunk number
+	 * @param hole - if not NULL, set to the bytes of zeros before the chunk
+	 * @return the bytes in it, 0 at the end of the file, -1 on failure
+	 */
+	int waitPosted(unsigned int seq, long* hole = NULL)
+	{
+		message msg;
+		if (waitMsg(strategy, msqid, &msg, MSG_BODY_SIZE(msg), SENDER_DATA_TYPE) == -1) {
+			fprintf(stderr, "message receive failure: %s\n", strerror(errno));
+			return -1;
+		}
+		if (msg.size == PEER_GONE_SIZE) {
+			fprintf(stderr, "The sender died mid-transfer\n");
+		}
+		if (hole != NULL) {
+			*hole = msg.size >= 0 ? msg.hole : 0;
+		}
+		return msg.size;
+	}
+
+	/**
+	 * Releases a chunk back to the sender (receiver)
+	 * @param seq - the chunk number
+	 * @param status - passed to the sender's waitAcked
+	 * @param credit - the sender may fill chunks numbered below this
+	 * @return true on success
+	 */
+	bool ack(unsigned int seq, int status = 0, unsigned int credit = 0)
+	{
+		message msg;
+		msg.mtype = RECV_DONE_TYPE;
+		msg.size = status;
+		msg.credit = credit;
+		msg.hole = 0;
+		if (msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0) == -1) {
+			fprintf(stderr, "message sent failure: %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Ends a wait for a peer that has died. It may be called from any
+	 * thread; the message stays queued if nobody is waiting yet.
+	 * @param msqid - the message queue
+	 * @param type - the type the waiting side receives: SENDER_DATA_TYPE
+	 *        for a receiver, RECV_DONE_TYPE for a sender
+	 * @return true on success
+	 */
+	static bool interrupt(int msqid, long type)
+	{
+		message msg;
+		msg.mtype = type;
+		msg.size = PEER_GONE_SIZE;
+		msg.credit = 0;
+		msg.hole = 0;
+		return msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), IPC_NOWAIT) == 0;
+	}
+
+private:
+	int msqid;
+	waitStrategy& strategy;
+
+	/* How many chunks the receiver has released */
+	unsigned int acked;
+
+	/* The highest credit the receiver has granted */
+	unsigned int credit;
+
+	/**
+	 * Receives one release from the receiver
+	 * @param msg - where to store it
+	 */
+	bool receiveAck(message& msg)
+	{
+		if (waitMsg(strategy, msqid, &msg, MSG_BODY_SIZE(msg), RECV_DONE_TYPE) == -1) {
+			fprintf(stderr, "failed to receive message from receiver: %s\n", strerror(errno));
+			return false;
+		}
+		if (msg.size == PEER_GONE_SIZE) {
+			fprintf(stderr, "The receiver died mid-transfer\n");
+			return false;
+		}
+		acked++;
+		if ((int)(msg.credit - credit) > 0) {
+			credit = msg.credit;
+		}
+		return true;
+	}
+};
+
+/**
+ * Real-time signals between the two processes: SIGUSR1 carries the size
+ * of a chunk in its value, SIGUSR2 releases one. Both signals must be
+ * blocked (see block()) before the peer can send them. Signals do not
+ * queue, so only one chunk may be outstanding whatever credit the
+ * receiver would grant. A signal value has no room for a hole, so
+ * every byte is sent. A signal we queue to ourselves carrying
+ * PEER_GONE_SIZE (see interrupt()) fails the wait.
+ */
+
+class SignalNotify
+{
+public:
+	/* Chunks cannot announce holes */
+	static const bool HOLES = false;
+
+	/**
+	 * @param peer - the PID of the other process
+	 * @param strategy - how to wait for the peer
+	 */
+	SignalNotify(pid_t peer, waitStrategy& strategy) : peer(peer), strategy(strategy), acked(0) {}
+
+	/**
+	 * Blocks a signal so it waits for sigwaitinfo instead of killing us
+	 * @param sig - SIGUSR1 for the receiver, SIGUSR2 for the sender
+	 * @return true on success
+	 */
+	static bool block(int sig)
+	{
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, sig);
+		if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
+			fprintf(stderr, "Failed to set signals mask: %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Sets the PID of the other process once it is known
+	 * @param pid - the PID
+	 */
+	void setPeer(pid_t pid)
+	{
+		peer = pid;
+	}
+
+	/**
+	 * Announces a chunk (sender)
+	 * @param seq - the chunk number
+	 * @param size - the bytes in it; 0 marks the end of the file
+	 * @param hole - must be 0
+	 * @return true on success
+	 */
+	bool post(unsigned int seq, int size, long hole = 0)
+	{
+		union sigval sigData;
+		sigData.sival_int = size;
+		if (sigqueue(peer, SIGUSR1, sigData) != 0) {
+			fprintf(stderr, "Failed to signal receiver. %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Waits until the receiver has released a chunk (sender)
+	 * @param seq - the chunk number
+	 * @param status - if not NULL, set to 0
+	 * @return true on success
+	 */
+	bool waitAcked(unsigned int seq, int* status = NULL)
+	{
+		siginfo_t sigInfo;
+		while ((int)(acked - seq) <= 0) {
+			if (waitFor(SIGUSR2, &sigInfo) == -1) {
+				fprintf(stderr, "Failed to receive signal from receiver. %s\n", strerror(errno));
+				return false;
+			}
+			if (sigInfo.si_code == SI_QUEUE && sigInfo.si_value.sival_int == PEER_GONE_SIZE) {
+				fprintf(stderr, "The receiver died mid-transfer\n");
+				return false;
+			}
+			acked++;
+		}
+		if (status != NULL) {
+			*status = 0;
+		}
+		return true;
+	}
+
+	/**
+	 * Waits until the chunk before has been released (sender)
+	 * @param seq - the chunk number
+	 * @return true on success
+	 */
+	bool waitCredit(unsigned int seq)
+	{
+		return waitAcked(seq - 1);
+	}
+
+	/**
+	 * Waits for the sender to announce a chunk (receiver)
+	 * @param seq - the chunk number
+	 * @param hole - if not NULL, set to 0
+	 * @return the bytes in it, 0 at the end of the file, -1 on failure
+	 */
+	int waitPosted(unsigned int seq, long* hole = NULL)
+	{
+		siginfo_t sigInfo;
+		if (hole != NULL) {
+			*hole = 0;
+		}
+		if (waitFor(SIGUSR1, &sigInfo) == -1) {
+			fprintf(stderr, "Failed to receive signal from sender. %s\n", strerror(errno));
+			return -1;
+		}
+		if (sigInfo.si_value.sival_int == PEER_GONE_SIZE) {
+			fprintf(stderr, "The sender died mid-transfer\n");
+		}
+		return sigInfo.si_value.sival_int;
+	}
+
+	/**
+	 * Releases a chunk back to the sender (receiver)
+	 * @param seq - the chunk number
+	 * @param status - ignored; a signal carries no status
+	 * @param credit - ignored
+	 * @return true on success
+	 */
+	bool ack(unsigned int seq, int status = 0, unsigned int credit = 0)
+	{
+		if (kill(peer, SIGUSR2) == -1) {
+			fprintf(stderr, "Failed to signal sender: %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Ends a wait for a peer that has died. It may be called from any
+	 * thread; the signal stays pending if nobody is waiting yet.
+	 * @param sig - the signal we wait for: SIGUSR1 for the receiver,
+	 *        SIGUSR2 for the sender
+	 * @return true on success
+	 */
+	static bool interrupt(int sig)
+	{
+		union sigval sigData;
+		sigData.sival_int = PEER_GONE_SIZE;
+		return sigqueue(getpid(), sig, sigData) == 0;
+	}
+
+private:
+	pid_t peer;
+	waitStrategy& strategy;
+
+	/* How many chunks the receiver has released */
+	unsigned int acked;
+
+	/**
+	 * Waits for one signal
+	 * @param sig - the signal
+	 * @param info - where to store its information
+	 */
+	int waitFor(int sig, siginfo_t* info)
+	{
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, sig);
+		return waitSignal(strategy, &set, info);
+	}
+};
+
+/**
+ * Counters in the broadcast slot ring: the sender's head and one tail
+ * and credit per receiver. The head and tails are waited on as futexes.
+ * The sender stops waiting for a receiver that died, and the receivers
+ * fail once the sender has (see interrupt()).
+ */
+
+class FutexNotify
+{
+public:
+	/* A chunk can announce a hole */
+	static const bool HOLES = true;
+
+	/**
+	 * @param ringPtr - the attached ring
+	 * @param reader - our cursor, or -1 for the sender
+	 * @param strategy - how to wait for the peers
+	 */
+	FutexNotify(ring* ringPtr, int reader, waitStrategy& strategy) : ringPtr(ringPtr), reader(reader), strategy(strategy) {}
+
+	/**
+	 * Publishes a chunk to every receiver at once (sender)
+	 * @param seq - the chunk number
+	 * @param size - the bytes in it; 0 with no hole marks the end of the file
+	 * @param hole - the bytes of zeros before them, sent as a length only
+	 * @return true
+	 */
+	bool post(unsigned int seq, int size, long hole = 0)
+	{
+		ringPtr->sizes[seq % BCAST_SLOT_COUNT] = size;
+		ringPtr->holes[seq % BCAST_SLOT_COUNT] = hole;
+		__atomic_store_n(&ringPtr->head, seq + 1, __ATOMIC_RELEASE);
+		futexWakeSleepers(&ringPtr->head, &ringPtr->headSleepers);
+		return true;
+	}
+
+	/**
+	 * Waits until every receiver has released a chunk (sender)
+	 * @param seq - the chunk number
+	 * @param status - if not NULL, set to 0
+	 * @return true
+	 */
+	bool waitAcked(unsigned int seq, int* status = NULL)
+	{
+		for (int i = 0; i < ringPtr->readerCount; i++) {
+			unsigned int tail = __atomic_load_n(&ringPtr->tails[i], __ATOMIC_ACQUIRE);
+			while ((int)(tail - seq) <= 0 && !dropped(i)) {
+				tail = waitChange(strategy, &ringPtr->tails[i], tail, &ringPtr->tailSleepers[i], &ringPtr->dropped[i]);
+			}
+		}
+		if (status != NULL) {
+			*status = 0;
+		}
+		return true;
+	}
+
+	/**
+	 * Waits until every receiver has granted credit to fill a chunk (sender)
+	 * @param seq - the chunk number
+	 * @return true
+	 */
+	bool waitCredit(unsigned int seq)
+	{
+		for (int i = 0; i < ringPtr->readerCount; i++) {
+			/* A receiver moves its tail after its credit, so watching the
+			   tail cannot miss a grant */
+			unsigned int tail = __atomic_load_n(&ringPtr->tails[i], __ATOMIC_ACQUIRE);
+			while ((int)(__atomic_load_n(&ringPtr->credits[i], __ATOMIC_ACQUIRE) - seq) <= 0 && !dropped(i)) {
+				tail = waitChange(strategy, &ringPtr->tails[i], tail, &ringPtr->tailSleepers[i], &ringPtr->dropped[i]);
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Waits for the sender to publish a chunk (receiver)
+	 * @param seq - the chunk number
+	 * @param hole - if not NULL, set to the bytes of zeros before the chunk
+	 * @return the bytes in it, 0 at the end of the file, -1 if the sender died
+	 */
+	int waitPosted(unsigned int seq, long* hole = NULL)
+	{
+		unsigned int head = __atomic_load_n(&ringPtr->head, __ATOMIC_ACQUIRE);
+		while ((int)(head - seq) <= 0) {
+			if (__atomic_load_n(&ringPtr->senderGone, __ATOMIC_ACQUIRE)) {
+				fprintf(stderr, "The sender died mid-transfer\n");
+				return -1;
+			}
+			head = waitChange(strategy, &ringPtr->head, head, &ringPtr->headSleepers, &ringPtr->senderGone);
+		}
+		if (hole != NULL) {
+			*hole = ringPtr->holes[seq % BCAST_SLOT_COUNT];
+		}
+		return ringPtr->sizes[seq % BCAST_SLOT_COUNT];
+	}
+
+	/**
+	 * Hands a slot back (receiver)
+	 * @param seq - the chunk number
+	 * @param status - ignored
+	 * @param credit - the sender may fill chunks numbered below this
+	 * @return true
+	 */
+	bool ack(unsigned int seq, int status = 0, unsigned int credit = 0)
+	{
+		if (credit != 0) {
+			__atomic_store_n(&ringPtr->credits[reader], credit, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&ringPtr->tails[reader], seq + 1, __ATOMIC_RELEASE);
+		futexWakeSleepers(&ringPtr->tails[reader], &ringPtr->tailSleepers[reader]);
+		return true;
+	}
+
+	/**
+	 * Ends the waits for a peer that has died. It may be called from any
+	 * thread of any process attached to the ring.
+	 * @param ringPtr - the attached ring
+	 * @param reader - the receiver that died, or -1 for the sender
+	 */
+	static void interrupt(ring* ringPtr, int reader)
+	{
+		unsigned int* flag = reader == -1 ? &ringPtr->senderGone : &ringPtr->dropped[reader];
+		__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+		futexWake(reader == -1 ? &ringPtr->head : &ringPtr->tails[reader]);
+	}
+
+	/**
+	 * Counts the receivers that died (sender)
+	 */
+	int droppedCount() const
+	{
+		int count = 0;
+		for (int i = 0; i < ringPtr->readerCount; i++) {
+			count += dropped(i) ? 1 : 0;
+		}
+		return count;
+	}
+
+private:
+	ring* ringPtr;
+	int reader;
+	waitStrategy& strategy;
+
+	/**
+	 * Whether a receiver died and is no longer waited for
+	 * @param i - its cursor
+	 */
+	bool dropped(int i) const
+	{
+		return __atomic_load_n(&ringPtr->dropped[i], __ATOMIC_ACQUIRE) != 0;
+	}
+};
+
+#endif
@@ -0,0 +1,68 @@
+/* The slot ring one sender shares with several receivers (TRANSPORT_BCAST) */
+
+#ifndef RING_H
+#define RING_H
+
+#include "watch.h"
+
+/* The number of slots in the ring */
+#define BCAST_SLOT_COUNT 16
+
+/* The size of each slot */
+#define BCAST_SLOT_SIZE (256 << 10)
+
+/* The most receivers one broadcast can feed */
+#define BCAST_MAX_READERS 64
+
+/* How long the sender waits for every receiver to attach before it
+   goes on without the ones that did not */
+#define BCAST_JOIN_MS 10000
+
+/**
+ * The shared segment layout. Slot n of the file lives in
+ * slots[n % BCAST_SLOT_COUNT]; the counters only ever grow.
+ */
+
+struct ring
+{
+	/* How many slots the sender has filled, including the one marking the end */
+	unsigned int head;
+
+	/* How many slots each reader has written out */
+	unsigned int tails[BCAST_MAX_READERS];
+
+	/* How many readers sleep on the head, and whether the sender sleeps
+	   on each tail, so a side that spins is not woken with a system call */
+	unsigned int headSleepers;
+	unsigned int tailSleepers[BCAST_MAX_READERS];
+
+	/* Each reader's credit: the sender may fill slots numbered below it.
+	   Updated before the reader's tail, which is what the sender waits on. */
+	unsigned int credits[BCAST_MAX_READERS];
+
+	/* How many readers the sender waits for */
+	int readerCount;
+
+	/* Readers that have not finished yet; the last one removes the queue */
+	int readersLeft;
+
+	/* Each reader's claim, which the sender watches */
+	owner readers[BCAST_MAX_READERS];
+
+	/* Set by the sender for a reader that died; it is no longer waited for */
+	unsigned int dropped[BCAST_MAX_READERS];
+
+	/* Set by a reader once the sender has died */
+	unsigned int senderGone;
+
+	/* How many bytes each slot holds; 0 with no hole marks the end of the file */
+	int sizes[BCAST_SLOT_COUNT];
+
+	/* The bytes of zeros before each slot's data, which are not in the slot */
+	long holes[BCAST_SLOT_COUNT];
+
+	/* The data */
+	char slots[BCAST_SLOT_COUNT][BCAST_SLOT_SIZE] __attribute__((aligned(4096)));
+};
+
+#endif
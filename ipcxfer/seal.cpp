@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "seal.h"
+
+/* The GCM nonce: the salt, then the chunk number */
+#define SEAL_NONCE_SIZE 12
+
+static_assert(SEAL_SALT_SIZE + sizeof(unsigned int) == SEAL_NONCE_SIZE, "the nonce is the salt and a chunk number");
+
+bool sealLoadKey(const char* path, unsigned char* key)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "failed to open key file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	EVP_MD_CTX* sha = EVP_MD_CTX_new();
+	bool ok = sha != NULL && EVP_DigestInit_ex(sha, EVP_sha256(), NULL) == 1;
+	char buffer[4096];
+	size_t n, total = 0;
+	while (ok && (n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		ok = EVP_DigestUpdate(sha, buffer, n) == 1;
+		total += n;
+	}
+	ok = ok && !ferror(fp) && total > 0 && EVP_DigestFinal_ex(sha, key, NULL) == 1;
+	EVP_MD_CTX_free(sha);
+	fclose(fp);
+	memset(buffer, 0, sizeof(buffer));
+	if (!ok) {
+		fprintf(stderr, "failed to read a key from %s\n", path);
+	}
+	return ok;
+}
+
+bool sealNewSalt(unsigned char* salt)
+{
+	if (RAND_bytes(salt, SEAL_SALT_SIZE) != 1) {
+		fprintf(stderr, "failed to pick a random nonce\n");
+		return false;
+	}
+	return true;
+}
+
+SealCipher::SealCipher() : ctx(EVP_CIPHER_CTX_new())
+{
+	memset(salt, 0, sizeof(salt));
+}
+
+SealCipher::~SealCipher()
+{
+	EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*)ctx);
+}
+
+bool SealCipher::init(const unsigned char* key, const unsigned char* salt)
+{
+	memcpy(this->salt, salt, SEAL_SALT_SIZE);
+
+	/* The key schedule is set up once; each chunk only sets its nonce */
+	if (ctx == NULL || EVP_CipherInit_ex((EVP_CIPHER_CTX*)ctx, EVP_aes_256_gcm(), NULL, key, NULL, -1) != 1) {
+		fprintf(stderr, "failed to set up AES-256-GCM\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Builds the nonce of a chunk
+ * @param salt - the transfer's salt
+ * @param seq - the chunk's number
+ * @param nonce - where to store SEAL_NONCE_SIZE bytes
+ */
+static void chunkNonce(const unsigned char* salt, unsigned int seq, unsigned char* nonce)
+{
+	memcpy(nonce, salt, SEAL_SALT_SIZE);
+	for (int i = 0; i < 4; i++) {
+		nonce[SEAL_SALT_SIZE + i] = seq >> (24 - 8 * i);
+	}
+}
+
+bool SealCipher::seal(unsigned int seq, const char* in, size_t size, char* out)
+{
+	EVP_CIPHER_CTX* cipher = (EVP_CIPHER_CTX*)ctx;
+	unsigned char nonce[SEAL_NONCE_SIZE];
+	int n;
+	chunkNonce(salt, seq, nonce);
+	return EVP_EncryptInit_ex(cipher, NULL, NULL, NULL, nonce) == 1 &&
+		EVP_EncryptUpdate(cipher, (unsigned char*)out, &n, (const unsigned char*)in, size) == 1 &&
+		EVP_EncryptFinal_ex(cipher, (unsigned char*)out + n, &n) == 1 &&
+		EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, SEAL_TAG_SIZE, out + size) == 1;
+}
+
+bool SealCipher::open(unsigned int seq, const char* in, size_t size, char* out)
+{
+	EVP_CIPHER_CTX* cipher = (EVP_CIPHER_CTX*)ctx;
+	unsigned char nonce[SEAL_NONCE_SIZE];
+	unsigned char tag[SEAL_TAG_SIZE];
+	size_t length = size - SEAL_TAG_SIZE;
+	int n;
+	chunkNonce(salt, seq, nonce);
+
+	/* Copy the tag first, as the slot may change under us */
+	memcpy(tag, in + length, SEAL_TAG_SIZE);
+	return EVP_DecryptInit_ex(cipher, NULL, NULL, NULL, nonce) == 1 &&
+		EVP_DecryptUpdate(cipher, (unsigned char*)out, &n, (const unsigned char*)in, length) == 1 &&
+		EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_SET_TAG, SEAL_TAG_SIZE, tag) == 1 &&
+		EVP_DecryptFinal_ex(cipher, (unsigned char*)out + n, &n) == 1;
+}
@@ -0,0 +1,431 @@
+/* Encrypted transfers. SealedIO wraps the I/O policy of a copying
+   transport, so every chunk is sealed with AES-256-GCM as it is read
+   and opened as it is written: the slots only ever hold ciphertext, and
+   a chunk the receiver cannot authenticate fails the transfer. OpenSSL
+   picks the AES-NI and PCLMULQDQ code where the CPU has them. */
+
+#ifndef SEAL_H
+#define SEAL_H
+
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+#include "msg.h"
+
+/* The size of the key, derived from the key file (SHA-256) */
+#define SEAL_KEY_SIZE 32
+
+/* The authentication tag after each chunk's ciphertext */
+#define SEAL_TAG_SIZE 16
+
+/* How many chunks the helper thread of a SealedIO works ahead */
+#define SEAL_QUEUE_DEPTH 4
+
+/**
+ * Reads a key file both sides were given, and derives the key from it
+ * @param path - the file; any secret of any length
+ * @param key - where to store the key
+ * @return true on success
+ */
+bool sealLoadKey(const char* path, unsigned char* key);
+
+/**
+ * Picks the random part of a transfer's nonces
+ * @param salt - where to store SEAL_SALT_SIZE bytes
+ * @return true on success
+ */
+bool sealNewSalt(unsigned char* salt);
+
+/**
+ * AES-256-GCM with one key for the transfer. Chunk seq is sealed under
+ * the nonce salt || seq, so no two chunks of any transfer share one as
+ * long as salts do not repeat, and a chunk replayed in another place
+ * does not authenticate.
+ */
+
+class SealCipher
+{
+public:
+	SealCipher();
+	~SealCipher();
+
+	/**
+	 * @param key - SEAL_KEY_SIZE bytes
+	 * @param salt - SEAL_SALT_SIZE bytes, from the sender
+	 * @return true on success
+	 */
+	bool init(const unsigned char* key, const unsigned char* salt);
+
+	/**
+	 * Encrypts a chunk and appends its tag. Works in place.
+	 * @param seq - the chunk's number
+	 * @param in - the plaintext
+	 * @param size - its size
+	 * @param out - where to store size + SEAL_TAG_SIZE bytes
+	 * @return true on success
+	 */
+	bool seal(unsigned int seq, const char* in, size_t size, char* out);
+
+	/**
+	 * Decrypts a chunk and checks its tag
+	 * @param seq - the chunk's number
+	 * @param in - the ciphertext and tag
+	 * @param size - their size, at least SEAL_TAG_SIZE
+	 * @param out - where to store size - SEAL_TAG_SIZE bytes; garbage
+	 *        unless it returns true
+	 * @return true if the chunk is authentic
+	 */
+	bool open(unsigned int seq, const char* in, size_t size, char* out);
+
+private:
+	void* ctx;
+	unsigned char salt[SEAL_SALT_SIZE];
+
+	/* Not copyable, as it owns the OpenSSL context */
+	SealCipher(const SealCipher&);
+	SealCipher& operator=(const SealCipher&);
+};
+
+/**
+ * An I/O policy that seals what it reads and opens what it writes. The
+ * chunks are numbered in the order the engine moves them, which both
+ * sides agree on. A chunk with no data, only a tag, marks the end of
+ * the file, so the receiver can tell a file that was cut short. Holes
+ * are not skipped: where the zeros are would travel in the clear.
+ *
+ * The cipher runs on a helper thread up to SEAL_QUEUE_DEPTH chunks
+ * away from the copy: the sender's helper reads and seals the next
+ * chunks while the engine posts this one, and the receiver's opens and
+ * writes the chunks the engine has already released. The helper's
+ * failures show on the next call.
+ */
+
+template <class IO>
+class SealedIO
+{
+public:
+	/**
+	 * @param io - the file
+	 * @param cipher - set up with the transfer's key and salt
+	 */
+	SealedIO(IO& io, SealCipher& cipher) : io(io), cipher(cipher), seq(0), plainBytes(0), ended(false),
+		chunkSize(0), queued(0), taken(0), error(0), finished(false), stopping(false), running(false), stall(-1)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&changed, NULL);
+	}
+
+	~SealedIO()
+	{
+		stop();
+		pthread_cond_destroy(&changed);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Reads and seals the next chunk
+	 * @param buffer - where to store it
+	 * @param size - the most bytes to store, tag included
+	 * @return the bytes stored, 0 once the end marker was, -1 on failure
+	 */
+	ssize_t read(char* buffer, size_t size)
+	{
+		if (ended) {
+			return 0;
+		}
+		if (size <= SEAL_TAG_SIZE) {
+			errno = EFBIG;
+			return -1;
+		}
+		if (!running && !start(size, reader)) {
+			return -1;
+		}
+		pthread_mutex_lock(&lock);
+		while (queued == taken && !finished) {
+			pthread_cond_wait(&changed, &lock);
+		}
+		if (queued == taken) {
+			errno = error;
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		pthread_mutex_unlock(&lock);
+
+		/* The helper does not touch a queued chunk until it is taken */
+		std::vector<char>& chunk = chunks[taken % SEAL_QUEUE_DEPTH];
+		size_t sealed = sizes[taken % SEAL_QUEUE_DEPTH];
+		if (sealed > size) {
+			errno = EFBIG;
+			return -1;
+		}
+		memcpy(buffer, chunk.data(), sealed);
+
+		pthread_mutex_lock(&lock);
+		taken++;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+
+		__atomic_add_fetch(&plainBytes, sealed - SEAL_TAG_SIZE, __ATOMIC_RELAXED);
+		ended = sealed == SEAL_TAG_SIZE;
+		return sealed;
+	}
+
+	/** Sealed chunks go out whole, holes included */
+	off_t hole(off_t most)
+	{
+		return 0;
+	}
+
+	/**
+	 * Queues a chunk to be opened and written out. The end marker waits
+	 * for the rest of the file, so it fails if any chunk was not authentic.
+	 * @param buffer - the sealed chunk
+	 * @param size - its size
+	 * @return true on success
+	 */
+	bool write(const char* buffer, size_t size)
+	{
+		if (ended || size < SEAL_TAG_SIZE) {
+			errno = EBADMSG;
+			return false;
+		}
+		if (!running && !start(size, writer)) {
+			return false;
+		}
+		pthread_mutex_lock(&lock);
+		while (queued - taken == SEAL_QUEUE_DEPTH && !finished) {
+			pthread_cond_wait(&changed, &lock);
+		}
+		if (finished) {
+			errno = error;
+			pthread_mutex_unlock(&lock);
+			return false;
+		}
+		pthread_mutex_unlock(&lock);
+
+		/* Copied into our own memory: the sender could still change the slot */
+		std::vector<char>& chunk = chunks[queued % SEAL_QUEUE_DEPTH];
+		if (chunk.size() < size) {
+			chunk.resize(size);
+		}
+		memcpy(chunk.data(), buffer, size);
+		sizes[queued % SEAL_QUEUE_DEPTH] = size;
+
+		pthread_mutex_lock(&lock);
+		queued++;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+
+		if (size != SEAL_TAG_SIZE) {
+			return true;
+		}
+		ended = true;
+		stop();
+		errno = error;
+		return error == 0;
+	}
+
+	/** A sealed transfer never announces holes */
+	bool skip(off_t size)
+	{
+		errno = EBADMSG;
+		return false;
+	}
+
+	/** The file is settled on the helper thread, which writes it */
+	long settle()
+	{
+		return __atomic_exchange_n(&stall, -1L, __ATOMIC_RELAXED);
+	}
+
+	int fd()
+	{
+		return io.fd();
+	}
+
+	/**
+	 * Stops the helper thread, if it is running. Must be called before
+	 * the file is closed.
+	 */
+	void stop()
+	{
+		if (!running) {
+			return;
+		}
+		pthread_mutex_lock(&lock);
+		stopping = true;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	/** The bytes of the file read or written so far, without the tags */
+	long bytes() const { return __atomic_load_n(&plainBytes, __ATOMIC_RELAXED); }
+
+	/** Whether the end marker went through, i.e. the whole file did */
+	bool complete() const { return ended && error == 0; }
+
+private:
+	IO& io;
+	SealCipher& cipher;
+	unsigned int seq;
+	long plainBytes;
+	bool ended;
+
+	/* The chunks between the helper thread and the engine, and their sealed sizes */
+	std::vector<char> chunks[SEAL_QUEUE_DEPTH];
+	size_t sizes[SEAL_QUEUE_DEPTH];
+	size_t chunkSize;
+
+	/* Guarded by lock: how many chunks went into the queue and came out,
+	   and why the helper finished, if it did */
+	unsigned int queued;
+	unsigned int taken;
+	int error;
+	bool finished;
+	bool stopping;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+	bool running;
+
+	/* Receiver: the last settle() result of the helper not yet collected */
+	long stall;
+
+	/* Receiver: the chunk being opened */
+	std::vector<char> plain;
+
+	/**
+	 * Starts the helper thread
+	 * @param size - the size of every sealed chunk, tag included
+	 * @param work - reader or writer
+	 * @return true on success
+	 */
+	bool start(size_t size, void* (*work)(void*))
+	{
+		chunkSize = size;
+		int result = pthread_create(&thread, NULL, work, this);
+		if (result != 0) {
+			errno = result;
+			return false;
+		}
+		running = true;
+		return true;
+	}
+
+	/**
+	 * Marks the helper finished
+	 * @param why - the errno value it failed with, or 0
+	 */
+	void finish(int why)
+	{
+		pthread_mutex_lock(&lock);
+		error = why;
+		finished = true;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/** Sender: reads and seals chunks until the end marker is queued */
+	static void* reader(void* arg)
+	{
+		SealedIO* self = (SealedIO*)arg;
+		for (;;) {
+			pthread_mutex_lock(&self->lock);
+			while (self->queued - self->taken == SEAL_QUEUE_DEPTH && !self->stopping) {
+				pthread_cond_wait(&self->changed, &self->lock);
+			}
+			bool stopping = self->stopping;
+			pthread_mutex_unlock(&self->lock);
+			if (stopping) {
+				self->finish(ECANCELED);
+				return NULL;
+			}
+
+			std::vector<char>& chunk = self->chunks[self->queued % SEAL_QUEUE_DEPTH];
+			chunk.resize(self->chunkSize);
+			if (self->seq == ~0U) {
+				self->finish(EFBIG);
+				return NULL;
+			}
+			ssize_t n = self->io.read(chunk.data(), self->chunkSize - SEAL_TAG_SIZE);
+			if (n < 0) {
+				self->finish(errno);
+				return NULL;
+			}
+			if (!self->cipher.seal(self->seq, chunk.data(), n, chunk.data())) {
+				self->finish(EIO);
+				return NULL;
+			}
+			self->seq++;
+			self->sizes[self->queued % SEAL_QUEUE_DEPTH] = n + SEAL_TAG_SIZE;
+
+			pthread_mutex_lock(&self->lock);
+			self->queued++;
+			pthread_cond_broadcast(&self->changed);
+			pthread_mutex_unlock(&self->lock);
+			if (n == 0) {
+				self->finish(0);
+				return NULL;
+			}
+		}
+	}
+
+	/** Receiver: opens and writes chunks until the end marker is written */
+	static void* writer(void* arg)
+	{
+		SealedIO* self = (SealedIO*)arg;
+		self->plain.resize(self->chunkSize);
+		for (;;) {
+			pthread_mutex_lock(&self->lock);
+			while (self->queued == self->taken && !self->stopping) {
+				pthread_cond_wait(&self->changed, &self->lock);
+			}
+			bool empty = self->queued == self->taken;
+			pthread_mutex_unlock(&self->lock);
+			if (empty) {
+				self->finish(ECANCELED);
+				return NULL;
+			}
+
+			std::vector<char>& chunk = self->chunks[self->taken % SEAL_QUEUE_DEPTH];
+			size_t size = self->sizes[self->taken % SEAL_QUEUE_DEPTH];
+			if (self->plain.size() < size) {
+				self->plain.resize(size);
+			}
+			if (!self->cipher.open(self->seq, chunk.data(), size, self->plain.data())) {
+				self->finish(EBADMSG);
+				return NULL;
+			}
+			self->seq++;
+			if (!self->io.write(self->plain.data(), size - SEAL_TAG_SIZE)) {
+				self->finish(errno);
+				return NULL;
+			}
+			__atomic_add_fetch(&self->plainBytes, size - SEAL_TAG_SIZE, __ATOMIC_RELAXED);
+			long stalled = self->io.settle();
+			if (stalled >= 0) {
+				__atomic_store_n(&self->stall, stalled, __ATOMIC_RELAXED);
+			}
+
+			pthread_mutex_lock(&self->lock);
+			self->taken++;
+			pthread_cond_broadcast(&self->changed);
+			pthread_mutex_unlock(&self->lock);
+			if (size == SEAL_TAG_SIZE) {
+				self->finish(0);
+				return NULL;
+			}
+		}
+	}
+
+	/* Not copyable, as it owns the thread */
+	SealedIO(const SealedIO&);
+	SealedIO& operator=(const SealedIO&);
+};
+
+#endif
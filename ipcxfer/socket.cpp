@@ -0,0 +1,468 @@
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <endian.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "socket.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/**
+ * Resolves an address. tcp:<port> means 127.0.0.1 on both sides: the
+ * stream is not authenticated, so listening on other interfaces takes
+ * an explicit host such as tcp:0.0.0.0:<port>.
+ * @param address - unix:<path>, tcp:<port> or tcp:<host>:<port>
+ * @param storage - where to store the socket address
+ * @param length - set to its length
+ * @return its address family, or -1 if it is bad
+ */
+static int parseAddress(const char* address, sockaddr_storage& storage, socklen_t& length)
+{
+	memset(&storage, 0, sizeof(storage));
+	if (strncmp(address, "unix:", 5) == 0) {
+		sockaddr_un* un = (sockaddr_un*)&storage;
+		const char* path = address + 5;
+		if (*path == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+			fprintf(stderr, "bad socket path: %s\n", path);
+			return -1;
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path);
+		length = sizeof(sockaddr_un);
+		return AF_UNIX;
+	}
+
+	if (strncmp(address, "tcp:", 4) == 0) {
+		/* The port is after the last colon; an IPv6 host may be in brackets */
+		char host[256] = "";
+		const char* port = strrchr(address + 4, ':');
+		if (port == NULL) {
+			port = address + 4;
+		} else {
+			const char* start = address + 4;
+			size_t size = port - start;
+			if (size >= 2 && start[0] == '[' && start[size - 1] == ']') {
+				start++;
+				size -= 2;
+			}
+			snprintf(host, sizeof(host), "%.*s", (int)size, start);
+			port++;
+		}
+
+		addrinfo hints;
+		addrinfo* found;
+		memset(&hints, 0, sizeof(hints));
+		/* Without a host both sides use IPv4, or they could disagree */
+		hints.ai_family = host[0] != '\0' ? AF_UNSPEC : AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		int error = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &found);
+		if (error != 0) {
+			fprintf(stderr, "failed to resolve %s: %s\n", address, gai_strerror(error));
+			return -1;
+		}
+		memcpy(&storage, found->ai_addr, found->ai_addrlen);
+		length = found->ai_addrlen;
+		int family = found->ai_family;
+		freeaddrinfo(found);
+		return family;
+	}
+
+	fprintf(stderr, "bad address %s, expected unix:<path> or tcp:[<host>:]<port>\n", address);
+	return -1;
+}
+
+/**
+ * Asks for SOCKET_BUFFER_SIZE buffers. The kernel caps them at
+ * net.core.wmem_max / rmem_max, which is fine.
+ * @param sock - the socket
+ */
+static void setBuffers(int sock)
+{
+	int size = SOCKET_BUFFER_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+int socketListen(const char* address)
+{
+	sockaddr_storage storage;
+	socklen_t length;
+	int family = parseAddress(address, storage, length);
+	if (family == -1) {
+		return -1;
+	}
+	int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* A socket file left by a crashed receiver would fail the bind */
+	int one = 1;
+	if (family == AF_UNIX) {
+		unlink(((sockaddr_un*)&storage)->sun_path);
+	} else {
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+
+	/* Before listening, so TCP scales its window to the buffer */
+	setBuffers(sock);
+	if (bind(sock, (sockaddr*)&storage, length) == -1 || listen(sock, 1) == -1) {
+		fprintf(stderr, "failed to listen on %s: %s\n", address, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int socketAccept(int listenFd, const char* address)
+{
+	int sock;
+	while ((sock = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) == -1 && errno == EINTR) {
+	}
+	if (sock == -1) {
+		fprintf(stderr, "failed to accept a sender: %s\n", strerror(errno));
+		return -1;
+	}
+	if (strncmp(address, "unix:", 5) == 0) {
+		unlink(address + 5);
+	}
+	return sock;
+}
+
+int socketConnect(const char* address)
+{
+	sockaddr_storage storage;
+	socklen_t length;
+	int family = parseAddress(address, storage, length);
+	if (family == -1) {
+		return -1;
+	}
+
+	/* The receiver may not be listening yet: retry while it is refused */
+	for (int waited = 0;; waited += 10) {
+		int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock == -1) {
+			fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+			return -1;
+		}
+		setBuffers(sock);
+		if (connect(sock, (sockaddr*)&storage, length) == 0) {
+			return sock;
+		}
+		int error = errno;
+		close(sock);
+		if ((error != ECONNREFUSED && error != ENOENT) || waited >= SOCKET_CONNECT_MS) {
+			fprintf(stderr, "failed to connect to %s: %s\n", address, strerror(error));
+			return -1;
+		}
+		struct timespec pause = {0, 10 * 1000000L};
+		nanosleep(&pause, NULL);
+	}
+}
+
+/**
+ * Sends a whole buffer
+ * @param sock - the socket
+ * @param buffer - the data
+ * @param size - its size
+ * @return true on success
+ */
+static bool sendAll(int sock, const void* buffer, size_t size)
+{
+	const char* data = (const char*)buffer;
+	while (size > 0) {
+		ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Receives a whole buffer
+ * @param sock - the socket
+ * @param buffer - where to store it
+ * @param size - its size
+ * @return true on success; false on failure or if the peer closed first
+ */
+static bool recvAll(int sock, void* buffer, size_t size)
+{
+	char* data = (char*)buffer;
+	while (size > 0) {
+		ssize_t n = recv(sock, data, size, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			errno = n == 0 ? ECONNRESET : errno;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Reads the MSG_ZEROCOPY completions queued so far. Once the kernel
+ * says it copied the data after all (over loopback, or to a device that
+ * cannot gather), zero-copy is turned off: pinning the pages then costs
+ * without saving anything.
+ * @param sock - the socket
+ * @param zerocopy - cleared if the kernel copied
+ * @param stats - where to count the copied sends
+ */
+static void reapCompletions(int sock, bool& zerocopy, socketStats& stats)
+{
+	for (;;) {
+		char control[256];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			return;
+		}
+		for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cm);
+			if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+				/* The sends numbered ee_info to ee_data */
+				stats.copied += err->ee_data - err->ee_info + 1;
+				zerocopy = false;
+			}
+		}
+	}
+}
+
+/**
+ * Sends a batch of chunks, with as few sendmsg calls as the socket allows
+ * @param sock - the socket
+ * @param iov - the chunks; changed as they go out
+ * @param count - how many
+ * @param zerocopy - whether to send with MSG_ZEROCOPY
+ * @param stats - where to count the calls
+ * @return true on success
+ */
+static bool sendBatch(int sock, iovec* iov, int count, bool& zerocopy, socketStats& stats)
+{
+	bool copyThis = false;
+	while (count > 0) {
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		int flags = MSG_NOSIGNAL | (zerocopy && !copyThis ? MSG_ZEROCOPY : 0);
+		ssize_t n = sendmsg(sock, &msg, flags);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		/* Too many completions unread to pin more pages: copy this batch */
+		if (n == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+			reapCompletions(sock, zerocopy, stats);
+			copyThis = true;
+			continue;
+		}
+		if (n == -1) {
+			return false;
+		}
+		stats.calls++;
+		stats.zerocopy += (flags & MSG_ZEROCOPY) != 0;
+
+		/* Skip what went out */
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+long socketSend(int sock, int fd, long size, progressFn progress, socketStats& stats)
+{
+	socketHello hello;
+	hello.magic = htobe32(SOCKET_MAGIC);
+	hello.flags = 0;
+	hello.fileSize = htobe64(size);
+	if (!sendAll(sock, &hello, sizeof(hello))) {
+		fprintf(stderr, "failed to send to receiver: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Send straight out of the page cache where the file can be mapped;
+	   a pipe is read a batch at a time */
+	char* fileMap = size > 0 ? (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : (char*)MAP_FAILED;
+	if (fileMap != MAP_FAILED) {
+		madvise(fileMap, size, MADV_SEQUENTIAL);
+	}
+	std::vector<char> buffer(fileMap == MAP_FAILED ? SOCKET_IOV_COUNT * SOCKET_CHUNK_SIZE : 0);
+
+	/* Zero-copy leaves the pages pinned until the data is acknowledged,
+	   so only the mapping, which we never change, may go that way. It
+	   is a TCP feature: a UNIX socket refuses it. */
+	int domain = 0, one = 1;
+	socklen_t domainSize = sizeof(domain);
+	bool zerocopy = fileMap != MAP_FAILED &&
+		getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &domainSize) == 0 && domain != AF_UNIX &&
+		setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+
+	long total = 0;
+	bool failed = false;
+	for (;;)
+	{
+		iovec iov[SOCKET_IOV_COUNT];
+		int count = 0;
+		long batch = 0;
+		if (fileMap != MAP_FAILED) {
+			while (count < SOCKET_IOV_COUNT && total + batch < size) {
+				long n = size - total - batch < SOCKET_CHUNK_SIZE ? size - total - batch : SOCKET_CHUNK_SIZE;
+				iov[count].iov_base = fileMap + total + batch;
+				iov[count++].iov_len = n;
+				batch += n;
+			}
+		} else {
+			for (ssize_t n = 1; count < SOCKET_IOV_COUNT && n > 0;) {
+				char* chunk = buffer.data() + count * SOCKET_CHUNK_SIZE;
+				n = read(fd, chunk, SOCKET_CHUNK_SIZE);
+				if (n == -1 && errno == EINTR) {
+					n = 1;
+					continue;
+				}
+				if (n == -1) {
+					fprintf(stderr, "failed to read from file: %s\n", strerror(errno));
+					failed = true;
+				}
+				if (n > 0) {
+					iov[count].iov_base = chunk;
+					iov[count++].iov_len = n;
+					batch += n;
+				}
+			}
+		}
+		if (failed || batch == 0) {
+			break;
+		}
+
+		if (!sendBatch(sock, iov, count, zerocopy, stats)) {
+			fprintf(stderr, "failed to send to receiver: %s\n", strerror(errno));
+			failed = true;
+			break;
+		}
+		total += batch;
+		if (progress != NULL) {
+			progress(total, batch);
+		}
+		if (zerocopy) {
+			reapCompletions(sock, zerocopy, stats);
+		}
+	}
+
+	/* Tell the receiver that was all, and wait for it to have written it */
+	long long confirmed = -1;
+	if (!failed) {
+		if (shutdown(sock, SHUT_WR) == -1 || !recvAll(sock, &confirmed, sizeof(confirmed))) {
+			fprintf(stderr, "The receiver did not confirm the file: %s\n", strerror(errno));
+			failed = true;
+		} else if ((confirmed = be64toh(confirmed)) == -1) {
+			fprintf(stderr, "The receiver failed to write the file\n");
+			failed = true;
+		} else if (confirmed != total) {
+			fprintf(stderr, "The receiver wrote %lld of %ld bytes\n", confirmed, total);
+			failed = true;
+		}
+	} else {
+		/* Reset the connection rather than end it, so the receiver fails too */
+		struct linger reset = {1, 0};
+		setsockopt(sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+	}
+	if (stats.zerocopy > 0) {
+		reapCompletions(sock, zerocopy, stats);
+	}
+	if (fileMap != MAP_FAILED) {
+		munmap(fileMap, size);
+	}
+	return failed ? -1 : total;
+}
+
+long socketRecv(int sock, int fd, progressFn progress)
+{
+	socketHello hello;
+	if (!recvAll(sock, &hello, sizeof(hello)) || be32toh(hello.magic) != SOCKET_MAGIC) {
+		fprintf(stderr, "The sender did not start a transfer\n");
+		return -1;
+	}
+	long size = be64toh(hello.fileSize);
+
+	std::vector<char> buffer(SOCKET_IOV_COUNT * SOCKET_CHUNK_SIZE);
+	long total = 0;
+	bool failed = false;
+	for (;;)
+	{
+		ssize_t n = recv(sock, buffer.data(), buffer.size(), 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			fprintf(stderr, "failed to receive from sender: %s\n", strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+
+		/* After a write error keep draining, so the sender hears about it */
+		for (ssize_t done = 0, written; !failed && done < n; done += written) {
+			written = write(fd, buffer.data() + done, n - done);
+			if (written == -1 && errno == EINTR) {
+				written = 0;
+			} else if (written <= 0) {
+				fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
+				failed = true;
+			}
+		}
+		total += n;
+		if (progress != NULL) {
+			progress(total, n);
+		}
+	}
+	if (size > 0 && total != size) {
+		fprintf(stderr, "The sender stopped after %ld of %ld bytes\n", total, size);
+		return -1;
+	}
+
+	/* Confirm only a file that was written whole; the sender fails on anything else */
+	long long confirmed = htobe64(failed ? -1 : total);
+	if (!sendAll(sock, &confirmed, sizeof(confirmed))) {
+		fprintf(stderr, "failed to confirm the file to the sender: %s\n", strerror(errno));
+		return -1;
+	}
+	return failed ? -1 : total;
+}
@@ -0,0 +1,159 @@
+/* The socket transport (-a): the file goes over a UNIX domain or TCP
+   stream instead of shared memory, so send and recv need no System V
+   objects or keyfile.txt and can run on different hosts. The stream is
+   a short header, the file, and the receiver's count of the bytes it
+   wrote coming back once the sender has shut down its side. Large
+   sends are batched, several chunks to a sendmsg, and over TCP go with
+   MSG_ZEROCOPY straight from the file's mapping. */
+
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <sys/types.h>
+#include "transport.h"
+
+/* The socket buffers we ask for, so a fast link is not starved between calls */
+#define SOCKET_BUFFER_SIZE (4 << 20)
+
+/* The bytes each iovec of a sendmsg covers, and the iovecs in one call */
+#define SOCKET_CHUNK_SIZE (256 << 10)
+#define SOCKET_IOV_COUNT 16
+
+/* How long send keeps trying to reach a receiver that is not listening yet */
+#define SOCKET_CONNECT_MS 10000
+
+/* Starts every stream */
+#define SOCKET_MAGIC 0x69707873
+
+/**
+ * What the sender sends before the file
+ */
+
+struct socketHello
+{
+	/* SOCKET_MAGIC */
+	unsigned int magic;
+
+	/* Unused, 0 */
+	unsigned int flags;
+
+	/* The size of the file in bytes (0 when the sender reads from a pipe) */
+	long fileSize;
+};
+
+/**
+ * What a send did, for the report
+ */
+
+struct socketStats
+{
+	/* sendmsg calls that moved data */
+	long calls;
+
+	/* Of those, the ones sent with MSG_ZEROCOPY, and the ones the
+	   kernel reported it copied after all (as over loopback) */
+	long zerocopy;
+	long copied;
+};
+
+/**
+ * Listens on an address
+ * @param address - unix:<path>, tcp:<port> for 127.0.0.1 only, or
+ *        tcp:<host>:<port> (tcp:0.0.0.0:<port> for every IPv4 interface,
+ *        tcp:[::]:<port> for IPv6). Anyone who can connect can send a
+ *        file, so only name other interfaces on a trusted network.
+ * @return the listening socket, or -1 on failure
+ */
+int socketListen(const char* address);
+
+/**
+ * Waits for the sender to connect. A UNIX socket's path is removed
+ * once it has.
+ * @param listenFd - the listening socket
+ * @param address - the address it listens on
+ * @return the connected socket, or -1 on failure
+ */
+int socketAccept(int listenFd, const char* address);
+
+/**
+ * Connects to a receiver, retrying for SOCKET_CONNECT_MS while nobody
+ * listens yet
+ * @param address - unix:<path> or tcp:<host>:<port> (tcp:<port> means
+ *        127.0.0.1)
+ * @return the connected socket, or -1 on failure
+ */
+int socketConnect(const char* address);
+
+/**
+ * Sends a file over a connected socket and waits for the receiver to
+ * confirm it wrote all of it
+ * @param sock - the socket
+ * @param fd - the file, mapped if it can be, read otherwise
+ * @param size - its size, or 0 if unknown
+ * @param progress - called after every sendmsg, or NULL
+ * @param stats - where to count the calls
+ * @return the bytes sent, or -1 on failure
+ */
+long socketSend(int sock, int fd, long size, progressFn progress, socketStats& stats);
+
+/**
+ * Receives a file from a connected socket
+ * @param sock - the socket
+ * @param fd - where to write it
+ * @param progress - called after every write, or NULL
+ * @return the bytes received, or -1 on failure
+ */
+long socketRecv(int sock, int fd, progressFn progress);
+
+/**
+ * The notification policy of a stream, which needs none: the kernel
+ * wakes the receiver when data arrives and the sender when there is
+ * buffer space
+ */
+
+class StreamNotify
+{
+public:
+	static const bool HOLES = false;
+};
+
+/**
+ * A connected stream socket (DIRECT)
+ */
+
+class SocketStream
+{
+public:
+	static const bool DIRECT = true;
+
+	/**
+	 * @param sock - the connected socket
+	 * @param size - the size of the file (sender), or 0
+	 */
+	explicit SocketStream(int sock, long size = 0) : sock(sock), size(size)
+	{
+		stats.calls = stats.zerocopy = stats.copied = 0;
+	}
+
+	template <class IO, class Notify>
+	long sendDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		return socketSend(sock, io.fd(), size, progress, stats);
+	}
+
+	template <class IO, class Notify>
+	long recvDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		return socketRecv(sock, io.fd(), progress);
+	}
+
+	/** What the sender did */
+	const socketStats& sendStats() const { return stats; }
+
+private:
+	int sock;
+	long size;
+	socketStats stats;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "transport.h"
+#include "io.h"
+
+bool canSplice(int fd)
+{
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		return false;
+	}
+
+	/* A pipe can always be spliced, and probing it would consume data */
+	if (S_ISFIFO(statbuf.st_mode)) {
+		return true;
+	}
+
+	/* Try to splice one byte at an explicit offset into a scratch pipe,
+	   which leaves the file position untouched */
+	int probe[2];
+	if (pipe(probe) == -1) {
+		return false;
+	}
+	loff_t offset = 0;
+	bool result = splice(fd, &offset, probe[1], NULL, 1, SPLICE_F_NONBLOCK) != -1;
+	close(probe[0]);
+	close(probe[1]);
+	return result;
+}
+
+/**
+ * Sends the file by splicing its pages into the FIFO shared with the
+ * receiver, so the data never passes through user space
+ * @param fd - the file to send
+ * @param progress - called after every splice, or NULL
+ * @return the bytes sent, or -1 on failure
+ */
+long spliceSend(int fd, progressFn progress)
+{
+	long total = 0;
+	ssize_t result;
+
+	/* Blocks until the receiver opens the other end */
+	if (mkfifo(SPLICE_FIFO_NAME, 0600) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+		return -1;
+	}
+	int pipeFd = open(SPLICE_FIFO_NAME, O_WRONLY);
+	if (pipeFd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+		return -1;
+	}
+
+	/* A bigger pipe lets each call move more pages. Failing only costs speed */
+	fcntl(pipeFd, F_SETPIPE_SZ, SPLICE_CHUNK_SIZE);
+
+	while ((result = splice(fd, NULL, pipeFd, NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+		total += result;
+		if (progress != NULL) {
+			progress(total, result);
+		}
+	}
+	if (result == -1) {
+		fprintf(stderr, "failed to splice file: %s. Was the receiver process killed?\n", strerror(errno));
+	}
+
+	/* Closing the write end is how the receiver learns the file has ended */
+	close(pipeFd);
+	return result == -1 ? -1 : total;
+}
+
+/**
+ * Receives a file the sender splices into the FIFO, moving the pages
+ * from the pipe to the file without copying them through user space
+ * @param fd - the file to write
+ * @param progress - called after every splice, or NULL
+ * @return the bytes received, or -1 on failure
+ */
+long spliceRecv(int fd, progressFn progress)
+{
+	long total = 0;
+	ssize_t result = 0;
+
+	/* Used only if the file system cannot be spliced into */
+	char* buffer = NULL;
+
+	/* Blocks until the sender opens the other end */
+	if (mkfifo(SPLICE_FIFO_NAME, 0600) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+		return -1;
+	}
+	int pipeFd = open(SPLICE_FIFO_NAME, O_RDONLY);
+	if (pipeFd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", SPLICE_FIFO_NAME, strerror(errno));
+		return -1;
+	}
+	FdIO out(fd);
+
+	/* Keep moving pages until the sender closes its end of the FIFO */
+	for (;;)
+	{
+		if (buffer == NULL) {
+			result = splice(pipeFd, NULL, fd, NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (result == -1 && errno == EINVAL && total == 0) {
+				/* The destination does not support splice, copy through user space */
+				buffer = (char*)malloc(SPLICE_CHUNK_SIZE);
+				if (buffer == NULL) {
+					break;
+				}
+				continue;
+			}
+		} else if ((result = read(pipeFd, buffer, SPLICE_CHUNK_SIZE)) > 0 && !out.write(buffer, result)) {
+			result = -1;
+		}
+		if (result <= 0) {
+			break;
+		}
+		total += result;
+		if (progress != NULL) {
+			progress(total, result);
+		}
+	}
+	if (result == -1) {
+		fprintf(stderr, "splicing to file failure: %s\n", strerror(errno));
+	}
+
+	free(buffer);
+	close(pipeFd);
+	return result == -1 ? -1 : total;
+}
+
+/**
+ * Wakes a spliceSend or spliceRecv of ours stuck opening the FIFO
+ * because the peer died before opening its end. Opening and closing
+ * both ends ourselves lets the open return; the sender then fails with
+ * EPIPE and the receiver sees the file end early.
+ */
+void spliceInterrupt()
+{
+	int readFd = open(SPLICE_FIFO_NAME, O_RDONLY | O_NONBLOCK);
+	if (readFd == -1) {
+		return;
+	}
+	int writeFd = open(SPLICE_FIFO_NAME, O_WRONLY | O_NONBLOCK);
+	if (writeFd != -1) {
+		close(writeFd);
+	}
+	close(readFd);
+}
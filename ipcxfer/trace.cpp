@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+/**
+ * The events one thread recorded. Only that thread writes it; head is
+ * published after the event, so a dump sees whole events.
+ */
+
+struct traceRing
+{
+	int tid;
+	unsigned int head;
+	traceEvent events[TRACE_RING_EVENTS];
+};
+
+bool traceEnabled = false;
+
+/* The file to dump to, and who we are */
+static char tracePath[4096];
+static char traceRole[20];
+
+/* Every thread's ring, in the order they first recorded */
+static traceRing* traceRings[TRACE_MAX_THREADS];
+static int traceRingCount = 0;
+
+/* The calling thread's ring, NULL until it first records, or (traceRing*)-1 if there was no room */
+static thread_local traceRing* ownRing = NULL;
+
+static const char* const traceNames[TRACE_EVENT_KINDS] = {
+	"unknown", "credit wait", "credit wait", "slot filled", "notify sent", "post wait", "post wait",
+	"write", "write", "write-back", "ack sent", "ack wait", "ack wait"
+};
+
+/**
+ * Dumps the trace on TRACE_DUMP_SIGNAL
+ * @param signal - the signal type
+ */
+static void traceDumpSignal(int signal)
+{
+	int savedErrno = errno;
+	traceDump();
+	errno = savedErrno;
+}
+
+/**
+ * Dumps the trace at exit
+ */
+static void traceDumpAtExit()
+{
+	if (!traceDump()) {
+		fprintf(stderr, "failed to write trace to %s: %s\n", tracePath, strerror(errno));
+	}
+}
+
+bool traceStart(const char* path, const char* role)
+{
+	if (strlen(path) >= sizeof(tracePath)) {
+		fprintf(stderr, "trace file name too long: %s\n", path);
+		return false;
+	}
+	strcpy(tracePath, path);
+	strncpy(traceRole, role, sizeof(traceRole) - 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = traceDumpSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(TRACE_DUMP_SIGNAL, &action, NULL) == -1 || atexit(traceDumpAtExit) != 0) {
+		fprintf(stderr, "failed to set up trace dumps: %s\n", strerror(errno));
+		return false;
+	}
+	traceEnabled = true;
+	return true;
+}
+
+void traceRecord(unsigned int kind, unsigned int seq, long long arg)
+{
+	traceRing* ring = ownRing;
+	if (__builtin_expect(ring == NULL, 0)) {
+		/* The first event from this thread: allocate and publish its ring */
+		int index = __atomic_fetch_add(&traceRingCount, 1, __ATOMIC_RELAXED);
+		ring = index < TRACE_MAX_THREADS ? (traceRing*)calloc(1, sizeof(traceRing)) : NULL;
+		if (ring == NULL) {
+			ownRing = (traceRing*)-1;
+			return;
+		}
+		ring->tid = syscall(SYS_gettid);
+		__atomic_store_n(&traceRings[index], ring, __ATOMIC_RELEASE);
+		ownRing = ring;
+	} else if (ring == (traceRing*)-1) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	traceEvent* event = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+	event->ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	event->seq = seq;
+	event->kind = kind;
+	event->arg = arg;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes a whole buffer, as write() may write less
+ * @param fd - the file
+ * @param buffer - the data
+ * @param size - its size
+ * @return true on success
+ */
+static bool writeAll(int fd, const void* buffer, size_t size)
+{
+	const char* data = (const char*)buffer;
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool traceDump()
+{
+	int fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return false;
+	}
+
+	/* The rings that exist now; one a thread adds meanwhile waits for the next dump */
+	traceRing* rings[TRACE_MAX_THREADS];
+	int threads = 0;
+	for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+		if ((rings[threads] = __atomic_load_n(&traceRings[i], __ATOMIC_ACQUIRE)) != NULL) {
+			threads++;
+		}
+	}
+
+	traceFile header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.pid = getpid();
+	header.threads = threads;
+	memcpy(header.role, traceRole, sizeof(header.role));
+	bool ok = writeAll(fd, &header, sizeof(header));
+
+	for (int i = 0; i < threads && ok; i++) {
+		traceRing* ring = rings[i];
+		/* The oldest slot may be overwritten while we copy it, so a full
+		   ring gives up its oldest event */
+		unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		traceThread thread;
+		thread.tid = ring->tid;
+		thread.count = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS - 1;
+		ok = writeAll(fd, &thread, sizeof(thread));
+
+		/* Oldest first: from the first kept event to the end of the array, then the start */
+		unsigned int first = (head - thread.count) & (TRACE_RING_EVENTS - 1);
+		unsigned int tail = TRACE_RING_EVENTS - first < thread.count ? TRACE_RING_EVENTS - first : thread.count;
+		ok = ok && writeAll(fd, &ring->events[first], tail * sizeof(traceEvent));
+		ok = ok && writeAll(fd, &ring->events[0], (thread.count - tail) * sizeof(traceEvent));
+	}
+
+	if (close(fd) == -1) {
+		ok = false;
+	}
+	return ok;
+}
+
+const char* traceEventName(unsigned int kind)
+{
+	return kind < TRACE_EVENT_KINDS ? traceNames[kind] : traceNames[0];
+}
@@ -0,0 +1,125 @@
+/* Tracing the transfer protocol. When enabled, the copy loops record
+   timestamped events into a ring per thread: when a slot was filled,
+   announced, waited for and written out. Each thread only writes its
+   own ring, so recording takes no lock and no system call. The rings
+   are dumped to a binary file at exit or on TRACE_DUMP_SIGNAL, and
+   tracejson turns the dumps of both processes into Chrome trace JSON
+   (chrome://tracing, ui.perfetto.dev) on one timeline. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <signal.h>
+
+/* Events each thread keeps; older ones are overwritten (a power of 2) */
+#define TRACE_RING_EVENTS (1 << 16)
+
+/* The most threads that can record */
+#define TRACE_MAX_THREADS 16
+
+/* Dumps the trace without stopping the process. Ignored by default, so
+   sending it to a process that is not tracing does no harm. */
+#define TRACE_DUMP_SIGNAL SIGURG
+
+/* The start of a trace file */
+#define TRACE_MAGIC "IPXTRACE"
+#define TRACE_VERSION 1
+
+/* The events. A _BEGIN and its _END bracket a wait or a write. */
+#define TRACE_CREDIT_WAIT_BEGIN 1   /* sender waits for credit to fill a slot */
+#define TRACE_CREDIT_WAIT_END 2
+#define TRACE_SLOT_FILLED 3         /* sender read a chunk into its slot; arg = bytes */
+#define TRACE_NOTIFY_SENT 4         /* sender announced it */
+#define TRACE_POST_WAIT_BEGIN 5     /* receiver waits for the next chunk */
+#define TRACE_POST_WAIT_END 6       /* ... and woke up with it; arg = bytes */
+#define TRACE_WRITE_BEGIN 7         /* receiver writes a chunk out */
+#define TRACE_WRITE_END 8
+#define TRACE_WRITEBACK 9           /* receiver stepped write-back; arg = ns stalled */
+#define TRACE_ACK_SENT 10           /* receiver released a slot; arg = credit granted */
+#define TRACE_ACK_WAIT_BEGIN 11     /* sender waits for the end of the file to be released */
+#define TRACE_ACK_WAIT_END 12
+#define TRACE_EVENT_KINDS 13
+
+/**
+ * One recorded event
+ */
+
+struct traceEvent
+{
+	/* CLOCK_MONOTONIC nanoseconds, the same clock in every process */
+	long long ns;
+
+	/* The chunk number */
+	unsigned int seq;
+
+	/* One of the TRACE_ event values */
+	unsigned int kind;
+
+	/* What the event says about the chunk, see the list above */
+	long long arg;
+};
+
+/**
+ * A trace file starts with this, followed by a traceThread and its
+ * events for every thread that recorded, oldest event first
+ */
+
+struct traceFile
+{
+	char magic[8];
+	int version;
+	int pid;
+	int threads;
+
+	/* Who recorded it, e.g. send or recv */
+	char role[20];
+};
+
+struct traceThread
+{
+	int tid;
+	unsigned int count;
+};
+
+/* Whether tracing is on; checked before every event */
+extern bool traceEnabled;
+
+/**
+ * Turns tracing on, and dumps the trace to a file at exit and on
+ * TRACE_DUMP_SIGNAL
+ * @param path - the file to dump to
+ * @param role - who is recording, e.g. send or recv
+ * @return true on success
+ */
+bool traceStart(const char* path, const char* role);
+
+/**
+ * Records an event on the calling thread's ring. Use TRACE instead,
+ * which costs a single test while tracing is off.
+ * @param kind - one of the TRACE_ event values
+ * @param seq - the chunk number
+ * @param arg - see the list above
+ */
+void traceRecord(unsigned int kind, unsigned int seq, long long arg);
+
+/**
+ * Writes every thread's ring to the file given to traceStart. It only
+ * makes async-signal-safe calls, so it can run in a signal handler.
+ * @return true on success
+ */
+bool traceDump();
+
+/**
+ * Gets the name an event kind is shown under
+ * @param kind - one of the TRACE_ event values
+ */
+const char* traceEventName(unsigned int kind);
+
+#define TRACE(kind, seq, arg) \
+	do { \
+		if (__builtin_expect(traceEnabled, 0)) { \
+			traceRecord((kind), (seq), (arg)); \
+		} \
+	} while (0)
+
+#endif
@@ -0,0 +1,190 @@
+/* Transport policies: where the chunks of the file travel. Copying
+   transports hand the engine slots of shared memory to fill and drain;
+   direct transports (DIRECT = true) move the whole file themselves,
+   with the kernel doing the copying. */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <unistd.h>
+#include "msg.h"
+#include "ring.h"
+
+/* Returned by a direct transport when the peer asked to go through
+   shared memory instead */
+#define XFER_FALLBACK -2
+
+/**
+ * Called after every chunk, to report progress
+ * @param total - the bytes moved so far
+ * @param size - the bytes in this chunk
+ */
+typedef void (*progressFn)(long total, long size);
+
+/* The direct transports, in splice.cpp and cma.cpp */
+bool canSplice(int fd);
+long spliceSend(int fd, progressFn progress);
+long spliceRecv(int fd, progressFn progress);
+void spliceInterrupt();
+void* cmaMap(int fd, long size);
+bool cmaAllow(pid_t recvPid);
+void cmaUnmap(void* fileMap, long size);
+long cmaRead(pid_t sendPid, unsigned long address, long size, int fd, progressFn progress);
+
+/**
+ * Chunks in the slots of the shared memory segment
+ */
+
+class ShmSegment
+{
+public:
+	static const bool DIRECT = false;
+
+	/**
+	 * @param sharedMemPtr - the attached segment
+	 * @param size - the size of each slot
+	 * @param count - the number of slots
+	 */
+	ShmSegment(void* sharedMemPtr, size_t size, unsigned int count) : base((char*)sharedMemPtr), size(size), count(count) {}
+
+	/** Where chunk seq lives */
+	char* slot(unsigned int seq) { return base + (seq % count) * size; }
+
+	/** How many chunks may be in flight */
+	unsigned int window() const { return count; }
+
+	/** The most bytes in a chunk */
+	size_t chunkSize() const { return size; }
+
+private:
+	char* base;
+	size_t size;
+	unsigned int count;
+};
+
+/**
+ * The broadcast slot ring: up to BCAST_SLOT_COUNT chunks in flight
+ */
+
+class RingSegment
+{
+public:
+	static const bool DIRECT = false;
+
+	/**
+	 * @param ringPtr - the attached ring
+	 */
+	explicit RingSegment(ring* ringPtr) : ringPtr(ringPtr) {}
+
+	/** Where chunk seq lives */
+	char* slot(unsigned int seq) { return ringPtr->slots[seq % BCAST_SLOT_COUNT]; }
+
+	/** How many chunks may be in flight */
+	unsigned int window() const { return BCAST_SLOT_COUNT; }
+
+	/** The most bytes in a chunk */
+	size_t chunkSize() const { return BCAST_SLOT_SIZE; }
+
+private:
+	ring* ringPtr;
+};
+
+/**
+ * Kernel zero-copy through the splice FIFO. The file descriptor must
+ * support splice (see canSplice); the notification policy is unused.
+ * The sender closing the FIFO ends the file, so the receiver checks
+ * the size the sender announced, if it knew one.
+ */
+
+class SpliceFifo
+{
+public:
+	static const bool DIRECT = true;
+
+	/**
+	 * @param size - the size of the file, or 0 if unknown
+	 */
+	explicit SpliceFifo(long size = 0) : size(size) {}
+
+	template <class IO, class Notify>
+	long sendDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		return spliceSend(io.fd(), progress);
+	}
+
+	template <class IO, class Notify>
+	long recvDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		long result = spliceRecv(io.fd(), progress);
+		if (result >= 0 && size > 0 && result != size) {
+			fprintf(stderr, "The sender stopped after %ld of %ld bytes\n", result, size);
+			return -1;
+		}
+		return result;
+	}
+
+private:
+	long size;
+};
+
+/**
+ * Cross-memory attach: the receiver releases chunk 0 with its PID, the
+ * sender lets that process (and no other) read its memory and posts
+ * chunk 0 empty. The receiver then copies the file straight out of the
+ * sender's mapping with process_vm_readv, and releases chunk 1 with
+ * status 0, or -1 if both sides must fall back to shared memory.
+ */
+
+class CmaMapping
+{
+public:
+	static const bool DIRECT = true;
+
+	/**
+	 * @param sendPid - the PID of the sender (0 on the sender side)
+	 * @param address - where the sender mapped the file
+	 * @param size - the size of the file
+	 */
+	CmaMapping(pid_t sendPid, unsigned long address, long size) : sendPid(sendPid), address(address), size(size) {}
+
+	template <class IO, class Notify>
+	long sendDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		int recvPid, status;
+		if (!notify.waitAcked(0, &recvPid)) {
+			return -1;
+		}
+		bool allowed = cmaAllow(recvPid);
+		if (!notify.post(0, allowed ? 0 : -1) || !notify.waitAcked(1, &status)) {
+			cmaAllow(0);
+			return -1;
+		}
+		cmaAllow(0);
+		return status == 0 ? size : XFER_FALLBACK;
+	}
+
+	template <class IO, class Notify>
+	long recvDirect(IO& io, Notify& notify, progressFn progress)
+	{
+		if (!notify.ack(0, getpid())) {
+			return -1;
+		}
+		int allowed = notify.waitPosted(0);
+		if (allowed == PEER_GONE_SIZE) {
+			return -1;
+		}
+		long result = allowed == 0 ? cmaRead(sendPid, address, size, io.fd(), progress) : -1;
+		if (!notify.ack(1, result == size ? 0 : -1)) {
+			return -1;
+		}
+		return result == size ? size : XFER_FALLBACK;
+	}
+
+private:
+	pid_t sendPid;
+	unsigned long address;
+	long size;
+};
+
+#endif
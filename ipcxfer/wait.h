@@ -0,0 +1,260 @@
+/* How a process waits for its peer: block, spin, or spin then block */
+
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/msg.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Sleep in the kernel right away */
+#define WAIT_BLOCK 0
+
+/* Poll and never sleep; costs a whole core while waiting */
+#define WAIT_SPIN 1
+
+/* Spinning yields the CPU this often, so a peer sharing the core can run */
+#define SPIN_YIELD_POLLS 1024
+
+/* Poll for an adaptive budget, then sleep */
+#define WAIT_ADAPTIVE 2
+
+/* The bounds of the adaptive budget, in polls */
+#define SPIN_MIN_BUDGET 16
+#define SPIN_MAX_BUDGET 16384
+
+/* How often a sleeper that can be aborted looks at its abort flag */
+#define WAIT_ABORT_POLL_MS 100
+
+/**
+ * The wait strategy and, for WAIT_ADAPTIVE, its current spin budget.
+ * The budget follows twice the typical number of polls a wait takes,
+ * and halves every time it runs out, so a peer that is usually slow
+ * quickly stops costing CPU.
+ */
+
+struct waitStrategy
+{
+	/* One of the WAIT_ values */
+	int kind;
+
+	/* How many polls before sleeping (WAIT_ADAPTIVE only) */
+	int budget;
+
+	/**
+	 * Whether to poll again
+	 * @param polls - the polls made so far
+	 */
+
+	bool keepSpinning(int polls)
+	{
+		return kind == WAIT_SPIN || (kind == WAIT_ADAPTIVE && polls < budget);
+	}
+
+	/**
+	 * Records a wait that ended while polling
+	 * @param polls - the polls it took
+	 */
+
+	void hit(int polls)
+	{
+		if (kind == WAIT_ADAPTIVE) {
+			budget += (2 * polls - budget) / 8;
+			budget = budget < SPIN_MIN_BUDGET ? SPIN_MIN_BUDGET : budget;
+			budget = budget > SPIN_MAX_BUDGET ? SPIN_MAX_BUDGET : budget;
+		}
+	}
+
+	/**
+	 * Records a wait that outlasted the budget
+	 */
+
+	void miss()
+	{
+		if (kind == WAIT_ADAPTIVE && budget / 2 >= SPIN_MIN_BUDGET) {
+			budget /= 2;
+		}
+	}
+};
+
+/**
+ * Parses a wait strategy name
+ * @param name - block, spin or adaptive
+ * @return the WAIT_ value, or -1 if the name is unknown
+ */
+
+inline int parseWaitStrategy(const char* name)
+{
+	if (strcmp(name, "block") == 0) {
+		return WAIT_BLOCK;
+	} else if (strcmp(name, "spin") == 0) {
+		return WAIT_SPIN;
+	} else if (strcmp(name, "adaptive") == 0) {
+		return WAIT_ADAPTIVE;
+	}
+	return -1;
+}
+
+/**
+ * Tells the CPU we are busy-waiting, which saves power and lets a
+ * sibling hyperthread run
+ * @param polls - the polls made so far
+ */
+
+inline void cpuRelax(int polls)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+	if (polls % SPIN_YIELD_POLLS == SPIN_YIELD_POLLS - 1) {
+		sched_yield();
+	}
+}
+
+/**
+ * Sleeps until another process changes a shared counter
+ * @param addr - the counter
+ * @param seen - the value the caller last saw; returns at once if it already changed
+ * @param timeoutMs - the longest to sleep, or 0 for no limit
+ */
+
+inline void futexWait(unsigned int* addr, unsigned int seen, int timeoutMs = 0)
+{
+	struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+	syscall(SYS_futex, addr, FUTEX_WAIT, seen, timeoutMs > 0 ? &timeout : NULL, NULL, 0);
+}
+
+/**
+ * Wakes every process sleeping on a shared counter
+ * @param addr - the counter
+ */
+
+inline void futexWake(unsigned int* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Receives a message the way the strategy says: polling with
+ * IPC_NOWAIT first, then blocking in msgrcv
+ * @param strategy - the wait strategy
+ * @param msqid - the message queue
+ * @param msg - where to store the message
+ * @param size - the size of the message body
+ * @param type - the message type to wait for
+ * @return what msgrcv returned
+ */
+
+inline ssize_t waitMsg(waitStrategy& strategy, int msqid, void* msg, size_t size, long type)
+{
+	for (int polls = 0; strategy.keepSpinning(polls); polls++) {
+		ssize_t result = msgrcv(msqid, msg, size, type, IPC_NOWAIT);
+		if (result != -1 || errno != ENOMSG) {
+			strategy.hit(polls);
+			return result;
+		}
+		cpuRelax(polls);
+	}
+	strategy.miss();
+
+	/* msgrcv is never restarted after a signal handler, e.g. a trace dump */
+	ssize_t result;
+	while ((result = msgrcv(msqid, msg, size, type, 0)) == -1 && errno == EINTR) {
+	}
+	return result;
+}
+
+/**
+ * Waits for one of a set of blocked signals the way the strategy says:
+ * polling with a zero sigtimedwait first, then sleeping in sigwaitinfo
+ * @param strategy - the wait strategy
+ * @param set - the signals to wait for
+ * @param info - where to store the signal's information
+ * @return the signal number, or -1 on failure
+ */
+
+inline int waitSignal(waitStrategy& strategy, const sigset_t* set, siginfo_t* info)
+{
+	const struct timespec zero = {0, 0};
+	for (int polls = 0; strategy.keepSpinning(polls); polls++) {
+		int sig = sigtimedwait(set, info, &zero);
+		if (sig != -1 || errno != EAGAIN) {
+			strategy.hit(polls);
+			return sig;
+		}
+		cpuRelax(polls);
+	}
+	strategy.miss();
+	int sig;
+	while ((sig = sigwaitinfo(set, info)) == -1 && errno == EINTR) {
+	}
+	return sig;
+}
+
+/**
+ * Wakes the processes sleeping on a shared counter, if there are any,
+ * so a peer that spins costs no system call. Call it after storing the
+ * new value.
+ * @param addr - the counter
+ * @param sleepers - the number of processes sleeping on it
+ */
+
+inline void futexWakeSleepers(unsigned int* addr, unsigned int* sleepers)
+{
+	/* Pairs with the increment in waitChange: either we see the
+	   sleeper or it sees the new value before it sleeps */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleepers, __ATOMIC_RELAXED) != 0) {
+		futexWake(addr);
+	}
+}
+
+/**
+ * Waits until a shared counter moves on from a value the way the
+ * strategy says: polling it first, then sleeping on it as a futex
+ * @param strategy - the wait strategy
+ * @param addr - the counter
+ * @param seen - the value the caller last saw
+ * @param sleepers - counts sleepers for futexWakeSleepers, or NULL if
+ *        the peer always wakes
+ * @param abort - if not NULL, the wait also ends once this is set;
+ *        whoever sets it need not wake us, we look every WAIT_ABORT_POLL_MS
+ * @return the new value, or seen if aborted
+ */
+
+inline unsigned int waitChange(waitStrategy& strategy, unsigned int* addr, unsigned int seen,
+	unsigned int* sleepers = NULL, const unsigned int* abort = NULL)
+{
+	unsigned int value;
+	for (int polls = 0; strategy.keepSpinning(polls); polls++) {
+		if ((value = __atomic_load_n(addr, __ATOMIC_ACQUIRE)) != seen ||
+			(abort != NULL && __atomic_load_n(abort, __ATOMIC_ACQUIRE))) {
+			strategy.hit(polls);
+			return value;
+		}
+		cpuRelax(polls);
+	}
+	strategy.miss();
+	if (sleepers != NULL) {
+		__atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+	while ((value = __atomic_load_n(addr, __ATOMIC_SEQ_CST)) == seen &&
+		(abort == NULL || !__atomic_load_n(abort, __ATOMIC_ACQUIRE))) {
+		futexWait(addr, seen, abort != NULL ? WAIT_ABORT_POLL_MS : 0);
+	}
+	if (sleepers != NULL) {
+		__atomic_sub_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+	return value;
+}
+
+#endif
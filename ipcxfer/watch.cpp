@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "watch.h"
+
+/**
+ * Reads when a process started from /proc
+ * @param pid - the process
+ * @param zombie - if not NULL, set to whether it has exited but not been reaped
+ * @return its start time in clock ticks since boot, or 0 if unknown
+ */
+static unsigned long long processStart(pid_t pid, bool* zombie = NULL)
+{
+	char path[64], line[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	size_t length = fread(line, 1, sizeof(line) - 1, fp);
+	fclose(fp);
+	line[length] = '\0';
+
+	/* The command name may hold spaces, so count fields from the last
+	   ')'; the start time is field 22, the 20th after it */
+	char* field = strrchr(line, ')');
+	if (zombie != NULL) {
+		*zombie = field != NULL && (field[2] == 'Z' || field[2] == 'X');
+	}
+	for (int i = 0; field != NULL && i < 20; i++) {
+		field = strchr(field + 1, ' ');
+	}
+	return field == NULL ? 0 : strtoull(field + 1, NULL, 10);
+}
+
+/**
+ * Opens a pidfd, which polls readable once the process exits
+ * @param pid - the process
+ * @return the pidfd, or -1 with errno set
+ */
+static int pidfdOpen(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+long long monotonicMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void ownerClaim(owner* rec)
+{
+	rec->start = processStart(getpid());
+	__atomic_store_n(&rec->heartbeat, monotonicMs(), __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->pid, getpid(), __ATOMIC_RELEASE);
+}
+
+bool ownerClaimOpen(owner* rec)
+{
+	pid_t none = 0;
+	rec->start = processStart(getpid());
+	__atomic_store_n(&rec->heartbeat, monotonicMs(), __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&rec->pid, &none, getpid(), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+bool ownerClose(owner* rec)
+{
+	pid_t none = 0;
+	return __atomic_compare_exchange_n(&rec->pid, &none, OWNER_CLOSED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void ownerRelease(owner* rec)
+{
+	pid_t self = getpid();
+	__atomic_compare_exchange_n(&rec->pid, &self, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+bool ownerAlive(const owner* rec)
+{
+	pid_t pid = __atomic_load_n(&rec->pid, __ATOMIC_ACQUIRE);
+	if (pid == 0 || pid == OWNER_CLOSED) {
+		return true;
+	}
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+		return false;
+	}
+	/* A different start time means the PID now belongs to someone else */
+	bool zombie = false;
+	unsigned long long start = processStart(pid, &zombie);
+	if (zombie || (start != 0 && rec->start != 0 && start != rec->start)) {
+		return false;
+	}
+	/* Without /proc, a process that stopped beating is taken for dead */
+	return start != 0 || monotonicMs() - __atomic_load_n(&rec->heartbeat, __ATOMIC_RELAXED) < HEARTBEAT_TIMEOUT_MS;
+}
+
+PeerWatch::PeerWatch() : self(NULL), peers(NULL), count(0), gone(NULL), stopFd(-1), running(false) {}
+
+PeerWatch::~PeerWatch()
+{
+	stop();
+}
+
+bool PeerWatch::start(owner* self, owner* peers, int count, peerGoneFn gone)
+{
+	this->self = self;
+	this->peers = peers;
+	this->count = count < WATCH_MAX_PEERS ? count : WATCH_MAX_PEERS;
+	this->gone = gone;
+
+	if ((stopFd = eventfd(0, EFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "failed to create watch eventfd: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* The transfer's blocked signals stay blocked in the thread, so
+	   SignalNotify's signals still reach the main thread */
+	int error = pthread_create(&thread, NULL, loop, this);
+	if (error != 0) {
+		fprintf(stderr, "failed to start watch thread: %s\n", strerror(error));
+		close(stopFd);
+		stopFd = -1;
+		return false;
+	}
+	running = true;
+	return true;
+}
+
+void PeerWatch::stop()
+{
+	if (running) {
+		unsigned long long one = 1;
+		if (write(stopFd, &one, sizeof(one)) == -1) {
+			fprintf(stderr, "failed to stop watch thread: %s\n", strerror(errno));
+		}
+		pthread_join(thread, NULL);
+		running = false;
+	}
+	if (stopFd != -1) {
+		close(stopFd);
+		stopFd = -1;
+	}
+}
+
+void* PeerWatch::loop(void* arg)
+{
+	((PeerWatch*)arg)->watch();
+	return NULL;
+}
+
+/**
+ * Beats every HEARTBEAT_MS and polls the pidfds of the peers that have
+ * claimed their records, until stop() is called
+ */
+void PeerWatch::watch()
+{
+	/* Per peer: the PID we watch, its pidfd, and whether we are done with it */
+	pid_t pids[WATCH_MAX_PEERS];
+	int pidfds[WATCH_MAX_PEERS];
+	bool done[WATCH_MAX_PEERS];
+	for (int i = 0; i < count; i++) {
+		pids[i] = 0;
+		pidfds[i] = -1;
+		done[i] = false;
+	}
+
+	struct pollfd fds[WATCH_MAX_PEERS + 1];
+	int index[WATCH_MAX_PEERS + 1];
+	bool stopping = false;
+
+	while (!stopping)
+	{
+		if (self != NULL) {
+			__atomic_store_n(&self->heartbeat, monotonicMs(), __ATOMIC_RELAXED);
+		}
+
+		fds[0].fd = stopFd;
+		fds[0].events = POLLIN;
+		int polled = 1;
+
+		for (int i = 0; i < count; i++) {
+			if (done[i]) {
+				continue;
+			}
+			pid_t pid = __atomic_load_n(&peers[i].pid, __ATOMIC_ACQUIRE);
+			if (pid == 0) {
+				/* Not here yet, or released: finished once we saw it */
+				done[i] = pids[i] != 0;
+				continue;
+			}
+			if (pid == OWNER_CLOSED) {
+				/* Never came, and whoever closed it stopped waiting */
+				done[i] = true;
+				continue;
+			}
+			if (pid != pids[i]) {
+				if (pidfds[i] != -1) {
+					close(pidfds[i]);
+				}
+				pids[i] = pid;
+				pidfds[i] = pidfdOpen(pid);
+				if (pidfds[i] == -1 && errno == ESRCH) {
+					done[i] = true;
+					if (__atomic_load_n(&peers[i].pid, __ATOMIC_ACQUIRE) == pid) {
+						gone(i);
+					}
+					continue;
+				}
+			}
+			/* The pidfd tells us at once; without one, look each beat */
+			if (!ownerAlive(&peers[i])) {
+				done[i] = true;
+				gone(i);
+			} else if (pidfds[i] != -1) {
+				fds[polled].fd = pidfds[i];
+				fds[polled].events = POLLIN;
+				index[polled++] = i;
+			}
+		}
+
+		if (poll(fds, polled, HEARTBEAT_MS) == -1) {
+			/* A signal: revents were not filled in, so look again */
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "failed to poll peers: %s\n", strerror(errno));
+			break;
+		}
+		stopping = fds[0].revents != 0;
+
+		for (int n = 1; n < polled && !stopping; n++) {
+			int i = index[n];
+			if (fds[n].revents == 0) {
+				continue;
+			}
+			/* It exited; if it released its record first, it had finished */
+			done[i] = true;
+			if (__atomic_load_n(&peers[i].pid, __ATOMIC_ACQUIRE) == pids[i]) {
+				gone(i);
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (pidfds[i] != -1) {
+			close(pidfds[i]);
+		}
+	}
+}
@@ -0,0 +1,134 @@
+/* Noticing a peer that died. Every process records itself as the owner
+   of its part of a shared segment; a watch thread keeps the record's
+   heartbeat going and tells the transfer when a peer's process exits
+   without having released its record, so a waiting peer fails fast
+   instead of hanging. */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+/* How often the watch thread beats and looks at its peers */
+#define HEARTBEAT_MS 250
+
+/* A peer that has not beaten for this long is dead, where pidfds are
+   not available to tell */
+#define HEARTBEAT_TIMEOUT_MS 5000
+
+/* The most peers one watch thread follows */
+#define WATCH_MAX_PEERS 64
+
+/**
+ * A process's claim on its part of a shared segment. The PID is 0 while
+ * nobody owns it; a process releases it once it has finished talking
+ * to its peers, so a PID still standing after the process exits means
+ * it died mid-transfer.
+ */
+
+struct owner
+{
+	/* The owner's PID, or 0 */
+	pid_t pid;
+
+	/* When it started, so a recycled PID is not taken for the owner */
+	unsigned long long start;
+
+	/* CLOCK_MONOTONIC milliseconds of its last heartbeat */
+	long long heartbeat;
+};
+
+/* The PID of a record nobody may claim any more (see ownerClaimOpen) */
+#define OWNER_CLOSED -1
+
+/**
+ * Records us as the owner
+ * @param rec - the record
+ */
+void ownerClaim(owner* rec);
+
+/**
+ * Records us as the owner of a record nobody owns, unless it has been
+ * closed: the owner's peer gave up waiting for it
+ * @param rec - the record
+ * @return false if it was closed
+ */
+bool ownerClaimOpen(owner* rec);
+
+/**
+ * Closes a record nobody has claimed, so a late owner is refused
+ * @param rec - the record
+ * @return false if it was claimed first
+ */
+bool ownerClose(owner* rec);
+
+/**
+ * Gives up a record we own, once the peers need nothing more from us
+ * @param rec - the record
+ */
+void ownerRelease(owner* rec);
+
+/**
+ * Tells whether the process that owns a record is still running
+ * @param rec - the record
+ * @return true if it is, or if the record is not owned
+ */
+bool ownerAlive(const owner* rec);
+
+/**
+ * Gets the current CLOCK_MONOTONIC time
+ * @return the time in milliseconds
+ */
+long long monotonicMs();
+
+/**
+ * Called from the watch thread when a peer dies
+ * @param index - which of the watched records it owned
+ */
+typedef void (*peerGoneFn)(int index);
+
+/**
+ * A thread that keeps our heartbeat going and reports peers that die.
+ * A peer that has not claimed its record yet is waited for; one that
+ * releases it is done and no longer watched.
+ */
+
+class PeerWatch
+{
+public:
+	PeerWatch();
+	~PeerWatch();
+
+	/**
+	 * Starts the thread
+	 * @param self - our record, whose heartbeat to keep, or NULL
+	 * @param peers - the peers' records
+	 * @param count - how many, at most WATCH_MAX_PEERS
+	 * @param gone - called once for every peer that dies
+	 * @return true on success
+	 */
+	bool start(owner* self, owner* peers, int count, peerGoneFn gone);
+
+	/**
+	 * Stops the thread, if it is running. Must be called before the
+	 * records are detached.
+	 */
+	void stop();
+
+private:
+	owner* self;
+	owner* peers;
+	int count;
+	peerGoneFn gone;
+
+	/* Written to by stop() to wake the thread */
+	int stopFd;
+	pthread_t thread;
+	bool running;
+
+	static void* loop(void* arg);
+	void watch();
+};
+
+#endif
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Runs the microbenchmarks and compares the best time of each with the
+# stored baseline, flagging those that got slower by more than THRESHOLD
+# percent. Exits with 1 if any did, so make microbench fails on them.
+# The baseline is only meaningful on the machine it was recorded on, so
+# a warning is printed when the host, the CPU count, the build of Google
+# Benchmark or the repetitions differ. Record a new one after changing
+# hardware, or when a change is meant to trade one cost for another.
+# USAGE: microbench/compare.sh [save]
+#   save                 record this run as the new baseline instead
+# Environment:
+#   THRESHOLD=25         the slowdown, in percent, that counts as a regression
+#   REPETITIONS=5        runs of each benchmark; the fastest is compared, as
+#                        noise (other processes, a busy host) only adds time
+#   FILTER=<regex>       only run the benchmarks whose names match
+
+DIR=$(dirname "$0")
+BASELINE=$DIR/baseline.json
+LATEST=$DIR/latest.json
+THRESHOLD=${THRESHOLD:-25}
+REPETITIONS=${REPETITIONS:-5}
+
+$DIR/microbench --benchmark_min_time=0.1 --benchmark_repetitions=$REPETITIONS \
+	--benchmark_filter="${FILTER:-.}" \
+	--benchmark_out=$LATEST --benchmark_out_format=json > /dev/null || exit 1
+
+if [ "$1" = save ] || [ ! -f $BASELINE ]; then
+	cp $LATEST $BASELINE
+	echo "Saved this run as the baseline in $BASELINE"
+	exit 0
+fi
+
+# Prints what a result file was recorded with: host, CPUs, library build, repetitions
+setup() {
+	awk -F'"' '/"(host_name|num_cpus|library_build_type|repetitions)":/ && !($2 in seen) {
+			seen[$2] = 1
+			value = $3
+			gsub(/[ ,:]/, "", value)
+			printf "%s=%s ", $2, value == "" ? $4 : value
+		}
+		END { print "" }' "$1"
+}
+
+BASESETUP=$(setup $BASELINE)
+LATESTSETUP=$(setup $LATEST)
+if [ "$BASESETUP" != "$LATESTSETUP" ]; then
+	echo "warning: the baseline was recorded on another machine or setup"
+	echo "  baseline: $BASESETUP"
+	echo "  this run: $LATESTSETUP"
+	echo "  record one here with ./microbench/compare.sh save"
+fi
+case $LATESTSETUP in
+	*library_build_type=debug*)
+		echo "warning: Google Benchmark reports a debug build (distribution packages built"
+		echo "  without NDEBUG do too); a release build gives more trustworthy numbers" ;;
+esac
+
+# Prints "name nanoseconds" for the fastest repetition of each benchmark in a result file
+fastest() {
+	awk '/"name":/ { gsub(/[",]/, "", $2); name = $2 }
+		/"run_type": "iteration"/ { repetition = 1 }
+		/"real_time":/ && repetition {
+			gsub(/,/, "", $2)
+			time = $2 + 0
+			if (!(name in best)) { names[++count] = name; best[name] = time }
+			best[name] = time < best[name] ? time : best[name]
+			repetition = 0
+		}
+		END { for (i = 1; i <= count; i++) print names[i], best[names[i]] }' "$1"
+}
+
+{ fastest $BASELINE | sed 's/^/baseline /'; fastest $LATEST | sed 's/^/latest /'; } | awk -v limit=$THRESHOLD '
+	$1 == "baseline" { base[$2] = $3; next }
+	{ names[++count] = $2; now[$2] = $3 }
+	END {
+		printf "%-32s %14s %14s %9s\n", "benchmark", "baseline ns", "now ns", "change"
+		for (i = 1; i <= count; i++) {
+			name = names[i]
+			if (!(name in base)) {
+				printf "%-32s %14s %14.1f %9s  new\n", name, "-", now[name], "-"
+				continue
+			}
+			change = (now[name] - base[name]) * 100 / base[name]
+			status = change > limit ? "REGRESSION" : change < -limit ? "faster" : ""
+			regressions += status == "REGRESSION"
+			printf "%-32s %14.1f %14.1f %+8.1f%%  %s\n", name, base[name], now[name], change, status
+		}
+		if (regressions > 0) {
+			printf "%d benchmarks are more than %d%% slower than the baseline\n", regressions, limit
+			exit 1
+		}
+		printf "No benchmark is more than %d%% slower than the baseline\n", limit
+	}'
@@ -0,0 +1,384 @@
+/* microbench - times the primitives a transfer is built from, one at a
+   time, with Google Benchmark: the notification round trips of the
+   message queue, signals and futexes, the copy into a shared memory
+   slot, stdio per chunk, and the per-chunk work of the sparse, dedup and
+   encryption paths. compare.sh runs it against the stored baseline. */
+
+#include <sys/shm.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "../ipcxfer/ipcxfer.h"
+
+/* Sent to an echo process to make it exit */
+#define ECHO_STOP -1
+
+/* The size of the file the stdio benchmarks read and write */
+#define STDIO_FILE_SIZE (16 << 20)
+
+/* The chunk sizes the copying benchmarks try: a queue message, the shm
+   transport's slot, a page, a dedup chunk and a broadcast slot */
+#define CHUNK_SIZES ->Arg(64)->Arg(SHARED_MEMORY_CHUNK_SIZE)->Arg(4096)->Arg(DEDUP_MAX_CHUNK)->Arg(BCAST_SLOT_SIZE)
+
+/**
+ * Forks a process that runs a function and exits
+ * @param serve - what it runs
+ * @return its PID, or -1 on failure
+ */
+template <class Fn>
+pid_t forkEcho(Fn serve)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		serve();
+		_exit(0);
+	}
+	return pid;
+}
+
+/**
+ * A chunk announcement and its release through a message queue, the
+ * way QueueNotify does it
+ */
+static void BM_QueueRoundTrip(benchmark::State& state)
+{
+	int msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+	if (msqid == -1) {
+		state.SkipWithError("msgget failed");
+		return;
+	}
+	pid_t echo = forkEcho([msqid]() {
+		message msg;
+		while (msgrcv(msqid, &msg, MSG_BODY_SIZE(msg), SENDER_DATA_TYPE, 0) != -1 && msg.size != ECHO_STOP) {
+			msg.mtype = RECV_DONE_TYPE;
+			msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0);
+		}
+	});
+
+	message msg;
+	memset(&msg, 0, sizeof(msg));
+	for (auto _ : state) {
+		msg.mtype = SENDER_DATA_TYPE;
+		msg.size = SHARED_MEMORY_CHUNK_SIZE;
+		if (msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0) == -1 ||
+			msgrcv(msqid, &msg, MSG_BODY_SIZE(msg), RECV_DONE_TYPE, 0) == -1) {
+			state.SkipWithError("message queue round trip failed");
+			break;
+		}
+	}
+
+	msg.mtype = SENDER_DATA_TYPE;
+	msg.size = ECHO_STOP;
+	msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0);
+	waitpid(echo, NULL, 0);
+	msgctl(msqid, IPC_RMID, NULL);
+}
+BENCHMARK(BM_QueueRoundTrip)->UseRealTime();
+
+/**
+ * A chunk announcement with sigqueue and its release with kill, each
+ * taken with sigwaitinfo, the way SignalNotify does it
+ */
+static void BM_SignalRoundTrip(benchmark::State& state)
+{
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &set, &old);
+
+	pid_t parent = getpid();
+	pid_t echo = forkEcho([parent]() {
+		sigset_t posted;
+		sigemptyset(&posted);
+		sigaddset(&posted, SIGUSR1);
+		siginfo_t info;
+		while (sigwaitinfo(&posted, &info) != -1 && info.si_value.sival_int != ECHO_STOP) {
+			kill(parent, SIGUSR2);
+		}
+	});
+
+	sigset_t acked;
+	sigemptyset(&acked);
+	sigaddset(&acked, SIGUSR2);
+	union sigval value;
+	value.sival_int = SHARED_MEMORY_CHUNK_SIZE;
+	siginfo_t info;
+	for (auto _ : state) {
+		if (sigqueue(echo, SIGUSR1, value) != 0 || sigwaitinfo(&acked, &info) == -1) {
+			state.SkipWithError("signal round trip failed");
+			break;
+		}
+	}
+
+	value.sival_int = ECHO_STOP;
+	sigqueue(echo, SIGUSR1, value);
+	waitpid(echo, NULL, 0);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+}
+BENCHMARK(BM_SignalRoundTrip)->UseRealTime();
+
+/**
+ * The counters two processes wake each other through
+ */
+struct futexPair
+{
+	unsigned int ping;
+	unsigned int pong;
+	unsigned int stop;
+};
+
+/**
+ * Waits on a shared counter until it moves past a value
+ * @param addr - the counter
+ * @param seen - the value it had
+ * @return its new value
+ */
+static unsigned int waitChange(unsigned int* addr, unsigned int seen)
+{
+	unsigned int value;
+	while ((value = __atomic_load_n(addr, __ATOMIC_ACQUIRE)) == seen) {
+		futexWait(addr, seen);
+	}
+	return value;
+}
+
+/**
+ * A counter bump and futex wake each way between two processes, the way
+ * FutexNotify sleeps and wakes when neither side spins
+ */
+static void BM_FutexPingPong(benchmark::State& state)
+{
+	futexPair* pair = (futexPair*)mmap(NULL, sizeof(futexPair), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pair == MAP_FAILED) {
+		state.SkipWithError("mmap failed");
+		return;
+	}
+	memset(pair, 0, sizeof(*pair));
+	pid_t echo = forkEcho([pair]() {
+		unsigned int seen = 0;
+		for (;;) {
+			seen = waitChange(&pair->ping, seen);
+			if (__atomic_load_n(&pair->stop, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			__atomic_store_n(&pair->pong, seen, __ATOMIC_RELEASE);
+			futexWake(&pair->pong);
+		}
+	});
+
+	unsigned int seq = 0;
+	for (auto _ : state) {
+		__atomic_store_n(&pair->ping, ++seq, __ATOMIC_RELEASE);
+		futexWake(&pair->ping);
+		waitChange(&pair->pong, seq - 1);
+	}
+
+	__atomic_store_n(&pair->stop, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&pair->ping, ++seq, __ATOMIC_RELEASE);
+	futexWake(&pair->ping);
+	waitpid(echo, NULL, 0);
+	munmap(pair, sizeof(futexPair));
+}
+BENCHMARK(BM_FutexPingPong)->UseRealTime();
+
+/**
+ * Copying a chunk into a slot of a shared memory segment, as the shm
+ * transports' senders do with fread
+ */
+static void BM_ShmCopy(benchmark::State& state)
+{
+	size_t size = state.range(0);
+	int shmid = shmget(IPC_PRIVATE, size, 0600 | IPC_CREAT);
+	char* segment = shmid == -1 ? (char*)-1 : (char*)shmat(shmid, NULL, 0);
+	if (shmid != -1) {
+		shmctl(shmid, IPC_RMID, NULL);
+	}
+	if (segment == (char*)-1) {
+		state.SkipWithError("shared memory failed");
+		return;
+	}
+	std::vector<char> chunk(size, 'x');
+	for (auto _ : state) {
+		memcpy(segment, chunk.data(), size);
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+	shmdt(segment);
+}
+BENCHMARK(BM_ShmCopy) CHUNK_SIZES;
+
+/**
+ * Creates a scratch file for the stdio benchmarks, already unlinked
+ * @param size - how many bytes to fill it with
+ * @return the open file, or NULL on failure
+ */
+static FILE* scratchFile(size_t size)
+{
+	char path[] = "/tmp/microbenchXXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		return NULL;
+	}
+	unlink(path);
+	FILE* fp = fdopen(fd, "w+");
+	std::vector<char> data(1 << 20, 'x');
+	for (size_t done = 0; fp != NULL && done < size; done += data.size()) {
+		fwrite(data.data(), 1, data.size(), fp);
+	}
+	if (fp != NULL) {
+		fflush(fp);
+		rewind(fp);
+	}
+	return fp;
+}
+
+/**
+ * Reading one chunk of a file with fread, as StdioIO does, from the page cache
+ */
+static void BM_FreadChunk(benchmark::State& state)
+{
+	size_t size = state.range(0);
+	FILE* fp = scratchFile(STDIO_FILE_SIZE);
+	if (fp == NULL) {
+		state.SkipWithError("no scratch file");
+		return;
+	}
+	std::vector<char> chunk(size);
+	for (auto _ : state) {
+		if (fread(chunk.data(), 1, size, fp) < size) {
+			rewind(fp);
+		}
+		benchmark::DoNotOptimize(chunk.data());
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+	fclose(fp);
+}
+BENCHMARK(BM_FreadChunk) CHUNK_SIZES;
+
+/**
+ * Writing one chunk of a file with fwrite, as StdioIO does, into the
+ * page cache. The file is rewritten from the start every
+ * STDIO_FILE_SIZE bytes so it stays the same size.
+ */
+static void BM_FwriteChunk(benchmark::State& state)
+{
+	size_t size = state.range(0);
+	FILE* fp = scratchFile(0);
+	if (fp == NULL) {
+		state.SkipWithError("no scratch file");
+		return;
+	}
+	std::vector<char> chunk(size, 'x');
+	size_t written = 0;
+	for (auto _ : state) {
+		if (fwrite(chunk.data(), 1, size, fp) != size) {
+			state.SkipWithError("fwrite failed");
+			break;
+		}
+		written += size;
+		if (written >= STDIO_FILE_SIZE) {
+			rewind(fp);
+			written = 0;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+	fclose(fp);
+}
+BENCHMARK(BM_FwriteChunk) CHUNK_SIZES;
+
+/**
+ * Checking a chunk for zeros (isZeroBlock), at its worst: a chunk that
+ * is all zeros has to be scanned to the end
+ */
+static void BM_ZeroCheck(benchmark::State& state)
+{
+	size_t size = state.range(0);
+	std::vector<char> chunk(size, 0);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(isZeroBlock(chunk.data(), size));
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_ZeroCheck) CHUNK_SIZES;
+
+/**
+ * Fills a buffer with the same pseudo-random bytes every run
+ * @param data - the buffer
+ */
+static void fillRandom(std::vector<char>& data)
+{
+	unsigned int state = 12345;
+	for (char& c : data) {
+		state = state * 1103515245 + 12345;
+		c = state >> 16;
+	}
+}
+
+/**
+ * Cutting random data into content-defined chunks (cdcCut), per byte
+ */
+static void BM_CdcCut(benchmark::State& state)
+{
+	std::vector<char> data(DEDUP_BUFFER_SIZE);
+	fillRandom(data);
+	size_t used = 0;
+	long bytes = 0;
+	for (auto _ : state) {
+		size_t size = cdcCut((const unsigned char*)data.data() + used, data.size() - used);
+		used = used + size < data.size() ? used + size : 0;
+		bytes += size;
+	}
+	state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_CdcCut);
+
+/**
+ * Naming a dedup chunk of the average size (chunkHash, SHA-256)
+ */
+static void BM_ChunkHash(benchmark::State& state)
+{
+	std::vector<char> data(DEDUP_AVG_CHUNK);
+	fillRandom(data);
+	chunkName name;
+	for (auto _ : state) {
+		chunkHash(data.data(), data.size(), name);
+		benchmark::DoNotOptimize(name.hash);
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ChunkHash);
+
+/**
+ * Sealing a chunk in place with AES-256-GCM (SealCipher), as -K does
+ */
+static void BM_SealChunk(benchmark::State& state)
+{
+	size_t size = state.range(0);
+	unsigned char key[SEAL_KEY_SIZE] = {1};
+	unsigned char salt[SEAL_SALT_SIZE] = {2};
+	SealCipher cipher;
+	if (!cipher.init(key, salt)) {
+		state.SkipWithError("no AES-256-GCM");
+		return;
+	}
+	std::vector<char> chunk(size + SEAL_TAG_SIZE);
+	fillRandom(chunk);
+	unsigned int seq = 0;
+	for (auto _ : state) {
+		cipher.seal(seq++, chunk.data(), size, chunk.data());
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_SealChunk) CHUNK_SIZES;
+
+BENCHMARK_MAIN();
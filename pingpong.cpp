@@ -0,0 +1,232 @@
+/** Measures request/response round trips of small messages, either
+ * through the inlined slot rings of msgring.h or, for comparison, the
+ * way send and recv move data: a copy through a shared memory segment
+ * plus a message queue notification each way.
+ */
+
+#include <sys/shm.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include "ipcxfer/msg.h"      /* For the message struct */
+#include "ipcxfer/msgring.h"  /* For the small-message rings */
+#include "ipcxfer/affinity.h"
+
+/* Round trips run before measuring, to warm caches and the spin budget */
+#define WARMUP_ROUND_TRIPS 1000
+
+/* The settings from the command line */
+int roundTrips = 100000;
+int payloadSize = 32;
+int strategy = WAIT_BLOCK;
+int clientCpu = -1;
+int serverCpu = -1;
+bool useQueue = false;
+
+/**
+ * Reads the monotonic clock
+ * @return the time in nanoseconds
+ */
+long nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Echoes every request back through the slot rings
+ * @param pair - the channel
+ */
+void ringServer(msgPair* pair)
+{
+	msgEndpoint ep;
+	msgEndpointInit(ep, pair, true, strategy);
+	char payload[MSGRING_MAX_SIZE];
+	for (int i = 0; i < WARMUP_ROUND_TRIPS + roundTrips; i++) {
+		int size = msgRingRecv(ep, payload, sizeof(payload));
+		msgRingSend(ep, payload, size);
+	}
+}
+
+/**
+ * Times round trips through the slot rings
+ * @param pair - the channel
+ * @param samples - set to the duration of each measured round trip
+ */
+void ringClient(msgPair* pair, long* samples)
+{
+	msgEndpoint ep;
+	msgEndpointInit(ep, pair, false, strategy);
+	char request[MSGRING_MAX_SIZE];
+	char response[MSGRING_MAX_SIZE];
+	memset(request, 'x', sizeof(request));
+	for (int i = 0; i < WARMUP_ROUND_TRIPS + roundTrips; i++) {
+		long start = nowNs();
+		msgRingSend(ep, request, payloadSize);
+		int size = msgRingRecv(ep, response, sizeof(response));
+		if (i >= WARMUP_ROUND_TRIPS) {
+			samples[i - WARMUP_ROUND_TRIPS] = nowNs() - start;
+		}
+		if (size != payloadSize || memcmp(request, response, size) != 0) {
+			fprintf(stderr, "Response %d does not match the request\n", i);
+			exit(-1);
+		}
+	}
+}
+
+/**
+ * Echoes every request back the way send and recv do it
+ * @param msqid - the message queue
+ * @param sharedMemPtr - the shared memory segment
+ */
+void queueServer(int msqid, void* sharedMemPtr)
+{
+	waitStrategy wait = {strategy, SPIN_MIN_BUDGET};
+	message msg;
+	char payload[MSGRING_MAX_SIZE];
+	for (int i = 0; i < WARMUP_ROUND_TRIPS + roundTrips; i++) {
+		waitMsg(wait, msqid, &msg, MSG_BODY_SIZE(msg), SENDER_DATA_TYPE);
+		memcpy(payload, sharedMemPtr, msg.size);
+		memcpy(sharedMemPtr, payload, msg.size);
+		msg.mtype = RECV_DONE_TYPE;
+		msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0);
+	}
+}
+
+/**
+ * Times round trips the way send and recv move data
+ * @param msqid - the message queue
+ * @param sharedMemPtr - the shared memory segment
+ * @param samples - set to the duration of each measured round trip
+ */
+void queueClient(int msqid, void* sharedMemPtr, long* samples)
+{
+	waitStrategy wait = {strategy, SPIN_MIN_BUDGET};
+	message msg;
+	char request[MSGRING_MAX_SIZE];
+	char response[MSGRING_MAX_SIZE];
+	memset(request, 'x', sizeof(request));
+	for (int i = 0; i < WARMUP_ROUND_TRIPS + roundTrips; i++) {
+		long start = nowNs();
+		memcpy(sharedMemPtr, request, payloadSize);
+		msg.mtype = SENDER_DATA_TYPE;
+		msg.size = payloadSize;
+		msgsnd(msqid, &msg, MSG_BODY_SIZE(msg), 0);
+		waitMsg(wait, msqid, &msg, MSG_BODY_SIZE(msg), RECV_DONE_TYPE);
+		memcpy(response, sharedMemPtr, msg.size);
+		if (i >= WARMUP_ROUND_TRIPS) {
+			samples[i - WARMUP_ROUND_TRIPS] = nowNs() - start;
+		}
+	}
+}
+
+/**
+ * Prints latency percentiles
+ * @param samples - the round trip durations, sorted in place
+ */
+void report(long* samples)
+{
+	std::sort(samples, samples + roundTrips);
+	long total = 0;
+	for (int i = 0; i < roundTrips; i++) {
+		total += samples[i];
+	}
+	fprintf(stdout, "%s, %d byte payload, %d round trips\n",
+		useQueue ? "shm + message queue" : "inline slot ring", payloadSize, roundTrips);
+	fprintf(stdout, "round trip ns: mean %ld  p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+		total / roundTrips,
+		samples[roundTrips / 2],
+		samples[(long)roundTrips * 90 / 100],
+		samples[(long)roundTrips * 99 / 100],
+		samples[(long)roundTrips * 999 / 1000],
+		samples[roundTrips - 1]);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:w:c:C:q")) != -1)
+	{
+		if (opt == 'n' && atoi(optarg) > 0) {
+			roundTrips = atoi(optarg);
+		} else if (opt == 's' && atoi(optarg) >= 0 && atoi(optarg) <= MSGRING_MAX_SIZE) {
+			payloadSize = atoi(optarg);
+		} else if (opt == 'w' && parseWaitStrategy(optarg) != -1) {
+			strategy = parseWaitStrategy(optarg);
+		} else if (opt == 'c') {
+			clientCpu = atoi(optarg);
+		} else if (opt == 'C') {
+			serverCpu = atoi(optarg);
+		} else if (opt == 'q') {
+			useQueue = true;
+		} else {
+			fprintf(stdout, "pingpong - measures small message round trips\n");
+			fprintf(stderr, "USAGE: %s [-n round trips] [-s payload bytes] [-w block|spin|adaptive]\n"
+				"       [-c client cpu] [-C server cpu] [-q (shm + message queue instead)]\n", argv[0]);
+			exit(-1);
+		}
+	}
+
+	/* The channel under test; private, since the server is our child */
+	int shmid = -1, msqid = -1;
+	msgPair* pair = (msgPair*)-1;
+	void* sharedMemPtr = (void*)-1;
+	if (useQueue) {
+		shmid = shmget(IPC_PRIVATE, MSGRING_MAX_SIZE, 0600 | IPC_CREAT);
+		msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+		sharedMemPtr = shmid == -1 ? (void*)-1 : shmat(shmid, NULL, 0);
+	} else {
+		shmid = shmget(IPC_PRIVATE, sizeof(msgPair), 0600 | IPC_CREAT);
+		pair = shmid == -1 ? (msgPair*)-1 : (msgPair*)shmat(shmid, NULL, 0);
+		sharedMemPtr = pair;
+	}
+	if (sharedMemPtr == (void*)-1 || (useQueue && msqid == -1)) {
+		fprintf(stderr, "Failed to create channel: %s\n", strerror(errno));
+		exit(-1);
+	}
+	/* Removed once both processes detach */
+	shmctl(shmid, IPC_RMID, NULL);
+
+	pid_t server = fork();
+	if (server == -1) {
+		fprintf(stderr, "Failed to start server: %s\n", strerror(errno));
+		exit(-1);
+	}
+	if (server == 0) {
+		if (serverCpu != -1 && pinToCpu(serverCpu) == -1) {
+			fprintf(stderr, "Failed to pin server to CPU %d: %s\n", serverCpu, strerror(errno));
+		}
+		if (useQueue) {
+			queueServer(msqid, sharedMemPtr);
+		} else {
+			ringServer(pair);
+		}
+		exit(0);
+	}
+
+	if (clientCpu != -1 && pinToCpu(clientCpu) == -1) {
+		fprintf(stderr, "Failed to pin client to CPU %d: %s\n", clientCpu, strerror(errno));
+	}
+	long* samples = new long[roundTrips];
+	if (useQueue) {
+		queueClient(msqid, sharedMemPtr, samples);
+	} else {
+		ringClient(pair, samples);
+	}
+	waitpid(server, NULL, 0);
+	report(samples);
+
+	delete[] samples;
+	shmdt(sharedMemPtr);
+	if (useQueue) {
+		msgctl(msqid, IPC_RMID, NULL);
+	}
+	return 0;
+}
@@ -1,18 +1,13 @@
-#include <sys/shm.h>
-#include <sys/msg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-//#include <cerror>
-#include "msg.h"    /* For the message struct */
+#include <fcntl.h>
+#include "ipcxfer/ipcxfer.h"
 
 
-/* The size of the shared memory chunk */
-#define SHARED_MEMORY_CHUNK_SIZE 1000
-
 /* The ids for the shared memory segment and the message queue */
 int shmid = -1, msqid = -1;
 
@@ -20,172 +15,334 @@ int shmid = -1, msqid = -1;
 void *sharedMemPtr = (void*)-1;
 
 /* The name of the received file */
-const char recvFileName[] = "recvfile";
+const char* recvFileName = "recvfile";
+
+/* Where the dedup transport keeps the chunks it has received */
+const char* storeDir = DEDUP_STORE_DIR;
+
+/* How to wait for the sender */
+waitStrategy peerWait = {WAIT_BLOCK, SPIN_MIN_BUDGET};
+
+/* False while other receivers of a broadcast still need the queue */
+bool lastReceiver = true;
+
+/* The number of the next block, for the progress report */
+int blockCounter = 1;
+
+/* The broadcast slot ring, while we receive from one */
+ring* ringPtr = (ring*)-1;
+
+/* Keeps our heartbeat and notices the sender dying */
+PeerWatch watch;
+
+/* Set by the watch thread; nobody is left to drain the queue for */
+bool senderDied = false;
+
+/* Whether we were given a key (-K), so only accept encrypted transfers */
+bool sealed = false;
+unsigned char sealKey[SEAL_KEY_SIZE];
+
+/* The sealed file while one is being received, which counts the bytes without the tags */
+SealedIO<StdioIO>* sealedFile = NULL;
+
+/* Where to listen for the sender with -a, or NULL to go through System V IPC */
+const char* socketAddress = NULL;
 
 void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr);
 
 
 /**
  * Sets up the shared memory segment and message queue
- * @param shmid - the id of the allocated shared memory 
+ * @param shmid - the id of the allocated shared memory
  * @param msqid - the id of the shared memory
  * @param sharedMemPtr - the pointer to the shared memory
  */
 
 void init(int& shmid, int& msqid, void*& sharedMemPtr)
 {
-	
-	/*  1. Create a file called keyfile.txt containing string "Hello world" (you may do
- 		   so manually or from the code).
-	    2. Use ftok("keyfile.txt", 'a') in order to generate the key.
-		3. Use the key in the TODO's below. Use the same key for the queue
-		   and the shared memory segment. This also serves to illustrate the difference
-		   between the key and the id used in message queues and shared memory. The id
-		   for any System V object (i.e. message queues, shared memory, and sempahores) 
-		   is unique system-wide among all System V objects. Two objects, on the other hand,
-		   may have the same key.
-	 */
-	
-	key_t key;
-	key = ftok("keyfile.txt", 'a');
-	if (key == -1) {
-		fprintf(stderr, "Failed to generate key: %s\n", strerror(errno));
+	if (!ipcOpen(shmid, msqid, sharedMemPtr, true)) {
 		exit(-1);
 	}
-	
-	/* Allocate a piece of shared memory with size SHARED_MEMORY_CHUNK_SIZE. */
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE, 0666 | IPC_CREAT);
-	if (shmid == -1) {
-		fprintf(stderr, "failed to obtain shared memory: %s\n", strerror(errno));
-		cleanUp(shmid, msqid, sharedMemPtr);
-		exit(-1);
+}
+
+/**
+ * Reports the file transfer status to stdout
+ * @param total - the bytes received so far
+ * @param size - the bytes in the last chunk
+ */
+void reportProgress(long total, long size)
+{
+	if (sealedFile != NULL) {
+		total = sealedFile->bytes();
 	}
-	
-	/* Attach to the shared memory */
-	sharedMemPtr = shmat(shmid, NULL, 0);
-	if (sharedMemPtr == (void*)-1) {
-		fprintf(stderr, "failed to obtain shared memory pointer: %s\n", strerror(errno));
-		cleanUp(shmid, msqid, sharedMemPtr);
-		exit(-1);
+	fprintf(stdout, "Reading block %d (%ld bytes transferred)\n", blockCounter++, total);
+}
+
+/**
+ * Called from the watch thread when the sender dies mid-transfer, to
+ * end whatever wait for it we are in
+ * @param index - unused; there is one sender
+ */
+void senderGone(int index)
+{
+	senderDied = true;
+	if (ringPtr != (ring*)-1) {
+		FutexNotify::interrupt(ringPtr, -1);
+	} else {
+		QueueNotify::interrupt(msqid, SENDER_DATA_TYPE);
+		spliceInterrupt();
 	}
-	/* Create the message queue */
-	msqid = msgget(key, 0666 | IPC_CREAT);
-	if (msqid == -1) {
-		fprintf(stderr, "failed to obtain message queue: %s\n", strerror(errno));
-		cleanUp(shmid, msqid, sharedMemPtr);
-		exit(-1);
+}
+
+/**
+ * Receives one copy of a broadcast from the slot ring
+ * @param helloMsg - the setup message naming the ring and our cursor
+ * @param io - the file to write
+ * @return the bytes received, or -1 on failure
+ */
+template <class IO>
+long recvBcast(const hello& helloMsg, IO& io)
+{
+	/* Other receivers may still be waiting for their setup message */
+	lastReceiver = false;
+
+	ring* attached = ringAttach(helloMsg.ringId);
+	if (attached == (ring*)-1) {
+		return -1;
+	}
+	ringPtr = attached;
+
+	/* Our record is in the ring, as the other receivers share the header */
+	owner* self = &ringPtr->readers[helloMsg.reader];
+	if (!ownerClaimOpen(self)) {
+		fprintf(stderr, "The sender stopped waiting for this receiver\n");
+		/* Not counted among the receivers left, so only detach */
+		int ringId = helloMsg.ringId;
+		ringPtr = (ring*)-1;
+		ringRemove(ringId, attached);
+		return -1;
 	}
-	/* Store the IDs and the pointer to the shared memory region in the corresponding parameters */
-	
+
+	/* Without the watch a dead sender would leave us waiting forever;
+	   the sender's watch sees us leave instead */
+	if (!watch.start(self, &channelHead(sharedMemPtr)->owners[OWNER_SENDER], 1, senderGone)) {
+		ringPtr = (ring*)-1;
+		lastReceiver = ringLeave(attached);
+		return -1;
+	}
+
+	RingSegment segment(ringPtr);
+	FutexNotify notify(ringPtr, helloMsg.reader, peerWait);
+	Receiver<RingSegment, FutexNotify, IO> receiver(segment, notify, io, reportProgress);
+	long result = receiver.run();
+
+	watch.stop();
+	if (result >= 0) {
+		ownerRelease(self);
+	}
+
+	/* The last receiver to finish removes the queue */
+	ringPtr = (ring*)-1;
+	lastReceiver = ringLeave(attached);
+	return result;
+}
+
+/**
+ * Receives the file through the slots of the shared memory segment
+ * @param io - the file to write
+ * @return the bytes received, or -1 on failure
+ */
+template <class IO>
+long recvShm(IO& io)
+{
+	ShmSegment segment(channelData(sharedMemPtr), SHARED_MEMORY_CHUNK_SIZE, SHARED_MEMORY_SLOT_COUNT);
+	QueueNotify notify(msqid, peerWait);
+	Receiver<ShmSegment, QueueNotify, IO> receiver(segment, notify, io, reportProgress);
+	return receiver.run();
 }
- 
 
 /**
  * The main loop
+ * @return the bytes received, or -1 on failure
  */
-void mainLoop()
+long mainLoop()
 {
-	/* The size of the mesage */
-	int msgSize = 0;
-	
-	/* Open the file for writing */
-	FILE* fp = fopen(recvFileName, "w");
-		
+	/* The setup message announcing the transport */
+	hello helloMsg;
+
+	fprintf(stdout, "Waiting for file transfer to begin...\n");
+	fflush(stdout);
+
+	/* A trace dump signal interrupts the wait; keep waiting */
+	ssize_t received;
+	while ((received = msgrcv(msqid, &helloMsg, MSG_BODY_SIZE(helloMsg), SENDER_HELLO_TYPE, 0)) == -1 && errno == EINTR) {
+	}
+	if (received == -1) {
+		fprintf(stderr, "message receive failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Open the file for writing. The cma transport maps it, so it needs
+	   read access too.
+	 *
+	 * NOTE: the received file will be saved into the file called
+	 * "recvfile" unless another name was given
+	 */
+	int fd = open(recvFileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	FILE* fp = fd == -1 ? NULL : fdopen(fd, "w+");
+
 	/* Error checks */
 	if(!fp)
 	{
-		fprintf(stderr, "failed to open file for received data: %s\n", recvFileName);	
+		fprintf(stderr, "failed to open file for received data: %s\n", recvFileName);
 		cleanUp(shmid, msqid, sharedMemPtr);
 		exit(-1);
 	}
-		
-    /* Receive the first message and get the message size. The message will 
-     * contain regular information. The message will be of SENDER_DATA_TYPE
-     * (the macro SENDER_DATA_TYPE is defined in msg.h).  If the size field
-     * of the message is not 0, then we copy that many bytes from the shared
-     * memory region to the file. Otherwise, if 0, then we close the file and
-     * exit.
-     *
-     * NOTE: the received file will always be saved into the file called
-     * "recvfile"
-     */
-	message msg;
-	int blockCounter = 1;
-	int fileSizeCounter = 0;
 
-	fprintf(stdout, "Waiting for file transfer to begin...\n");
-	fflush(stdout);
+	StdioIO io(fp);
+	int transport = helloMsg.transport;
 
-	int result = msgrcv(msqid, &msg, sizeof(msg), SENDER_DATA_TYPE, 0);
-	fprintf(stdout, "Received message from send for %d bytes. ", msg.size);
-	if (result != -1) {
-		// Report the status of the file transfer
-		fileSizeCounter += msg.size;
-		fprintf(stdout, "Reading block %d (%d bytes transferred)\n", blockCounter++, fileSizeCounter);
-		fflush(stdout);
-	} else {
-		fprintf(stderr, "message receive failed: %s\n", strerror(errno));
-		// for this error, the while loop will be skipped and the file will be closed
+	/* An encrypted transfer needs our key, and with a key we take
+	   nothing else. Either way the sender fails once we remove the queue. */
+	SealCipher cipher;
+	SealedIO<StdioIO> sealedIO(io, cipher);
+	sealedFile = sealed ? &sealedIO : NULL;
+	if (helloMsg.sealed != sealed) {
+		fprintf(stderr, sealed ? "The sender does not encrypt the file; refusing it\n" :
+			"The sender encrypts the file; give recv the key with -K\n");
+		fclose(fp);
+		return -1;
+	}
+	if (sealed && !cipher.init(sealKey, helloMsg.salt)) {
+		fclose(fp);
+		return -1;
 	}
-	msgSize = msg.size;
 
-	/* Keep receiving until the sender set the size to 0, indicating that
- 	 * there is no more data to send
- 	 */	
+	/* Tell the sender who we are, and follow it in turn */
+	channelHeader* header = channelHead(sharedMemPtr);
+	if (transport != TRANSPORT_BCAST) {
+		ownerClaim(&header->owners[OWNER_RECEIVER]);
+		if (!watch.start(&header->owners[OWNER_RECEIVER], &header->owners[OWNER_SENDER], 1, senderGone)) {
+			fprintf(stdout, "File transfer failed.                   \n");
+			sealedFile = NULL;
+			fclose(fp);
+			return -1;
+		}
+	}
 
-	while(msgSize != 0)
-	{	
+	/* The bytes received, or -1 */
+	long result = -1;
 
-		/* Save the shared memory to file */
-		if((result = fwrite(sharedMemPtr, sizeof(char), msgSize, fp)) < 0)
-		{
-			fprintf(stderr, "writing to file failure: %s\n", strerror(errno));
-			cleanUp(shmid, msqid, sharedMemPtr);
-			break;
-		}
-		
-		/* Tell the sender that we are ready for the next file chunk. 
-			* I.e. send a message of type RECV_DONE_TYPE (the value of size field
-			* does not matter in this case). 
-			*/
-		msg.mtype = RECV_DONE_TYPE;
-		fprintf(stdout, "Sending message to send. ");
-		result = msgsnd(msqid, &msg, sizeof(msg), 0);
-		if (result == -1) {
-			fprintf(stderr, "message sent failure: %s\n", strerror(errno));
-			break;
+	if (transport == TRANSPORT_SPLICE) {
+		SpliceFifo fifo(helloMsg.fileSize);
+		QueueNotify notify(msqid, peerWait);
+		Receiver<SpliceFifo, QueueNotify, StdioIO> receiver(fifo, notify, io, reportProgress);
+		result = receiver.run();
+	}
+	if (transport == TRANSPORT_BCAST) {
+		result = sealed ? recvBcast(helloMsg, sealedIO) : recvBcast(helloMsg, io);
+	}
+	if (transport == TRANSPORT_CMA) {
+		CmaMapping mapping(queueSenderPid(msqid), helloMsg.address, helloMsg.fileSize);
+		QueueNotify notify(msqid, peerWait);
+		Receiver<CmaMapping, QueueNotify, StdioIO> receiver(mapping, notify, io, reportProgress);
+		result = receiver.run();
+		if (result == XFER_FALLBACK) {
+			fprintf(stdout, "Cannot read sender memory, using shared memory instead\n");
+			if (ftruncate(io.fd(), 0) == -1) {
+				fprintf(stderr, "failed to truncate %s: %s\n", recvFileName, strerror(errno));
+			}
+			transport = TRANSPORT_SHM;
 		}
+	}
+	if (transport == TRANSPORT_DEDUP) {
+		ChunkStore store(storeDir);
+		store.open();
+		DedupSegment segment(channelData(sharedMemPtr), &store);
+		QueueNotify notify(msqid, peerWait);
+		Receiver<DedupSegment, QueueNotify, StdioIO> receiver(segment, notify, io, reportProgress);
+		result = receiver.run();
+	}
+	if (transport == TRANSPORT_SHM) {
+		result = sealed ? recvShm(sealedIO) : recvShm(io);
+	}
 
-		// Wait for the next message from the sender regarding the next block 
-		// in the file that is being transferred
-		result = msgrcv(msqid, &msg, sizeof(msg), SENDER_DATA_TYPE, 0);
-		fprintf(stdout, "Received message from send for %d bytes. ", msg.size);
-		if (result != -1) {
-			// Receive was successful, report status to the console
-			// This update will allow the next update to replace this one with \r
-			// instead of \n
-			fileSizeCounter += msg.size;
-			fprintf(stdout, "Reading block %d (%d bytes transferred)\n", blockCounter++, fileSizeCounter);
-			fflush(stdout);
+	/* Without the sealed end marker the file may have been cut short */
+	if (sealed && result >= 0) {
+		if (!sealedIO.complete()) {
+			fprintf(stderr, "The encrypted file ended without its end marker\n");
+			result = -1;
 		} else {
-			fprintf(stderr, "message receive failure: %s\n", strerror(errno));
-			break;
+			result = sealedIO.bytes();
 		}
-		msgSize = msg.size;
-	
 	}
-	
+
 	// report to the output that the file transfer is complete or has failed
-	if (result != -1) {
-		fprintf(stdout, "File transfer complete (%d bytes)       \n", fileSizeCounter);
+	watch.stop();
+	if (result >= 0) {
+		/* Done with the sender: exiting now is not dying on it */
+		if (transport != TRANSPORT_BCAST) {
+			ownerRelease(&header->owners[OWNER_RECEIVER]);
+		}
+		fprintf(stdout, "File transfer complete (%ld bytes)       \n", result);
 	} else {
 		fprintf(stdout, "File transfer failed.                   \n");
 	}
-	/* Close the file */
+	/* Close the file, once the sealing thread has let go of it */
+	sealedIO.stop();
+	sealedFile = NULL;
 	fclose(fp);
+
+	/* Let the sender collect its last releases before the queue goes */
+	if (transport != TRANSPORT_BCAST && !senderDied) {
+		ipcDrain(msqid);
+	}
+
+	return result;
 }
 
+/**
+ * Receives the file over a socket: listens on socketAddress and takes
+ * the first sender to connect
+ * @return the bytes received, or -1 on failure
+ */
+long socketLoop()
+{
+	int listenFd = socketListen(socketAddress);
+	if (listenFd == -1) {
+		return -1;
+	}
+	fprintf(stdout, "Waiting for a sender on %s...\n", socketAddress);
+	fflush(stdout);
+	int sock = socketAccept(listenFd, socketAddress);
+	close(listenFd);
+	if (sock == -1) {
+		return -1;
+	}
 
+	FILE* fp = fopen(recvFileName, "w");
+	if (!fp)
+	{
+		fprintf(stderr, "failed to open file for received data: %s\n", recvFileName);
+		close(sock);
+		return -1;
+	}
+
+	StdioIO io(fp);
+	SocketStream stream(sock);
+	StreamNotify notify;
+	Receiver<SocketStream, StreamNotify, StdioIO> receiver(stream, notify, io, reportProgress);
+	long result = receiver.run();
+	if (result >= 0) {
+		fprintf(stdout, "File transfer complete (%ld bytes)       \n", result);
+	} else {
+		fprintf(stdout, "File transfer failed.                   \n");
+	}
+	fclose(fp);
+	close(sock);
+
+	return result;
+}
 
 /**
  * Perfoms the cleanup functions
@@ -197,19 +354,12 @@ void mainLoop()
 void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr)
 {
 	/* Detach from shared memory */
-	int result = shmdt(sharedMemPtr);
-	if (result == -1) {
-		fprintf(stderr, "Failed to detach shared memory: %s\n", strerror(errno));
-	}
-	/* Deallocate the shared memory chunk */
-	result = shmctl(shmid, IPC_RMID, NULL);
-	if (result == -1) {
-		fprintf(stderr, "Failed to deallocate the shared memory: %s\n", strerror(errno));
-	}
-	/* Deallocate the message queue */
-	result = msgctl(msqid, IPC_RMID, NULL);
-	if (result == -1) {
-		fprintf(stderr, "Failed to deallocate message queue: %s\n", strerror(errno));
+	watch.stop();
+	ipcDetach(sharedMemPtr);
+
+	/* Other receivers of a broadcast are still using the queue */
+	if (lastReceiver) {
+		ipcRemove(shmid, msqid);
 	}
 }
 
@@ -228,19 +378,79 @@ void ctrlCSignal(int signal)
 }
 
 int main(int argc, char** argv)
-{	
+{
+	/* The CPU to pin to, or -1 */
+	int pinnedCpu = -1;
+
+	/* Where to dump the protocol trace, or NULL */
+	const char* tracePath = NULL;
+	int opt;
+
+	/* Check the command line arguments */
+	while ((opt = getopt(argc, argv, "w:c:T:D:K:a:")) != -1)
+	{
+		if (opt == 'w' && parseWaitStrategy(optarg) != -1) {
+			peerWait.kind = parseWaitStrategy(optarg);
+		} else if (opt == 'c') {
+			pinnedCpu = atoi(optarg);
+		} else if (opt == 'T') {
+			tracePath = optarg;
+		} else if (opt == 'D') {
+			storeDir = optarg;
+		} else if (opt == 'K') {
+			/* sealLoadKey has said what is wrong with the key file */
+			if (!sealLoadKey(optarg, sealKey)) {
+				exit(-1);
+			}
+			sealed = true;
+		} else if (opt == 'a') {
+			socketAddress = optarg;
+		} else {
+			fprintf(stdout, "recv - receives data from a sender\n");
+			fprintf(stderr, "USAGE: %s [-w block|spin|adaptive] [-c cpu] [-T trace file] [-D chunk store]\n"
+				"       [-K key file] [-a unix:<path>|tcp:[<host>:]<port>] [OUTPUT FILE]\n"
+				"-a tcp:<port> listens on 127.0.0.1 only; tcp:0.0.0.0:<port> accepts other hosts,\n"
+				"and any of them can send a file\n", argv[0]);
+			exit(-1);
+		}
+	}
+
+	/* A socket carries the file as it is */
+	if (socketAddress != NULL && sealed) {
+		fprintf(stderr, "-a cannot be combined with -K\n");
+		exit(-1);
+	}
+
+	/* Save the file under another name, e.g. when several receivers share a directory */
+	if (optind < argc) {
+		recvFileName = argv[optind];
+	}
+
+	if (pinnedCpu != -1 && pinToCpu(pinnedCpu) == -1) {
+		fprintf(stderr, "Failed to pin to CPU %d: %s\n", pinnedCpu, strerror(errno));
+		exit(-1);
+	}
+
+	/* Record the protocol's events, dumped at exit */
+	if (tracePath != NULL && !traceStart(tracePath, "recv")) {
+		exit(-1);
+	}
+
 	/* Overide the default signal handler for the
 	 * SIGINT signal with signalHandlerFunc
 	 */
-	signal(SIGINT, ctrlCSignal); 
-				
-	/* Initialize */
-	init(shmid, msqid, sharedMemPtr);
-	
-	/* Go to the main loop */
-	mainLoop(); 
+	signal(SIGINT, ctrlCSignal);
+
+	/* Initialize, and go to the main loop; a socket needs no System V objects */
+	long result;
+	if (socketAddress != NULL) {
+		result = socketLoop();
+	} else {
+		init(shmid, msqid, sharedMemPtr);
+		result = mainLoop();
+	}
 
 	/* Detach from shared memory segment, and deallocate shared memory and message queue (i.e. call cleanup) **/
-	cleanUp(shmid, msqid, sharedMemPtr);	
-	return 0;
+	cleanUp(shmid, msqid, sharedMemPtr);
+	return result < 0 ? 1 : 0;
 }
@@ -1,68 +1,68 @@
 
-#include <sys/shm.h>
-#include <sys/msg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <signal.h>
-#include "msg.h"    /* For the message struct */
-
-/* The size of the shared memory chunk */
-#define SHARED_MEMORY_CHUNK_SIZE 1000
+#include "ipcxfer/ipcxfer.h"
 
 /* The ids for the shared memory segment and the message queue */
-int shmid, msqid;
+int shmid = -1, msqid = -1;
 
 /* The pointer to the shared memory */
-void* sharedMemPtr;
+void* sharedMemPtr = (void*)-1;
+
+/* How to wait for the receiver */
+waitStrategy peerWait = {WAIT_BLOCK, SPIN_MIN_BUDGET};
+
+/* The CPU we are pinned to, or -1. Shared memory we fill goes on its NUMA node */
+int pinnedCpu = -1;
+
+/* The broadcast slot ring, if one was created */
+int ringId = -1;
+ring* ringPtr = (ring*)-1;
+
+/* The size of the file being sent (0 for a pipe) */
+long fileSize = 0;
+
+/* Keeps our heartbeat and notices receivers that die */
+PeerWatch watch;
+
+/* Whether to encrypt the chunks (-K), and the key and salt to do it with */
+bool sealed = false;
+unsigned char sealKey[SEAL_KEY_SIZE];
+
+/* The sealed file while one is being sent, which counts the bytes without the tags */
+SealedIO<StdioIO>* sealedFile = NULL;
+unsigned char sealSalt[SEAL_SALT_SIZE];
+
+/* Where the receiver listens with -a, or NULL to go through System V IPC */
+const char* socketAddress = NULL;
 
 void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr);
+
 /**
  * Sets up the shared memory segment and message queue
- * @param shmid - the id of the allocated shared memory 
- * @param msqid - the id of the shared memory
+ * @param shmid - the id of the allocated shared memory
+ * @param msqid - the id of the message queue
+ * @param sharedMemPtr - the pointer to the shared memory
  */
 
 void init(int& shmid, int& msqid, void*& sharedMemPtr)
 {
-	/* Get a unique key by using a file called keyfile.txt containing string 	
-	   and call ftok("keyfile.txt", 'b') in order to generate the key.
-	 */
-	key_t key;
-	key = ftok("keyfile.txt", 'a');
-	if (key == -1) {
-		fprintf(stderr, "Failed to generate key: %s\n", strerror(errno));
+	/* We write the segment first, so our node decides where its pages live */
+	if (!ipcOpen(shmid, msqid, sharedMemPtr, true, NULL, pinnedCpu != -1)) {
 		exit(-1);
 	}
 
-	/* Get the id of the shared memory segment. The size of the segment is SHARED_MEMORY_CHUNK_SIZE */
-	/* obtain the identifier of a previously created shared memory segment 
-	   (when shmflg is zero and key does not have the value IPC_PRIVATE)
-	*/
-	
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE, 0666 | IPC_CREAT);
-	if (shmid == -1) {
-		fprintf(stderr, "failed to obtain shared memory: %s\n", strerror(errno));
-		exit(-1);
-	}
-	/* Obtain the shared memory pointer for the memory segment */
-	sharedMemPtr = shmat(shmid, NULL, IPC_CREAT);
-	if (sharedMemPtr == (void*)-1) {
-		fprintf(stderr, "failed to obtain shared memory pointer: %s\n", strerror(errno));
-		exit(-1);
-	}
-	
-	
-	/* Attach to the message queue */
-	msqid = msgget(key, 0666 | IPC_CREAT);
-	if (msqid == -1) {
-		fprintf(stderr, "failed to obtain message queue: %s\n", strerror(errno));
-		cleanUp(shmid, msqid, sharedMemPtr);
-		exit(-1);
-	}
+	/* The receiver claims its record once our setup message arrives, so
+	   whatever is in it now is left from an earlier transfer */
+	channelHeader* header = channelHead(sharedMemPtr);
+	header->owners[OWNER_RECEIVER].pid = 0;
+	ownerClaim(&header->owners[OWNER_SENDER]);
 }
 
 /**
@@ -74,36 +74,190 @@ void init(int& shmid, int& msqid, void*& sharedMemPtr)
 
 void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr)
 {
-	/* Detach from shared memory
+	/* Remove the broadcast ring and detach from shared memory.
 	   recv will clean up all resource after file transfer is finished
 	 */
-	int result = shmdt(sharedMemPtr);
-	if (result == -1) {
-		fprintf(stderr, "failed to detach shared memory: %s\n", strerror(errno));
+	watch.stop();
+	if (ringId != -1) {
+		ringRemove(ringId, ringPtr);
+	}
+	ipcDetach(sharedMemPtr);
+}
+
+/**
+ * Reports the file transfer status to stdout
+ * @param total - the bytes sent so far
+ * @param size - the bytes in the last chunk
+ */
+void reportProgress(long total, long size)
+{
+	if (sealedFile != NULL) {
+		total = sealedFile->bytes();
+	}
+	if (fileSize > 0) {
+		fprintf(stdout, "File transfer: %.2lf%%. Sent %ld bytes\n", total * 100.0 / fileSize, size);
+	} else {
+		fprintf(stdout, "File transfer: %ld bytes. Sent %ld bytes\n", total, size);
 	}
 }
 
+/**
+ * Called from the watch thread when a receiver dies mid-transfer, to
+ * end whatever wait for it we are in
+ * @param index - its cursor in the broadcast ring, or 0
+ */
+void receiverGone(int index)
+{
+	if (ringPtr != (ring*)-1) {
+		FutexNotify::interrupt(ringPtr, index);
+	} else {
+		QueueNotify::interrupt(msqid, RECV_DONE_TYPE);
+		spliceInterrupt();
+	}
+}
+
+/**
+ * Sends the setup message telling the receiver how the file will arrive
+ * @param transport - the TRANSPORT_ value
+ * @param address - where the file is mapped (TRANSPORT_CMA only)
+ * @param reader - the receiver's cursor in the ring (TRANSPORT_BCAST only)
+ * @return true on success
+ */
+bool sendHello(int transport, unsigned long address, int reader)
+{
+	hello helloMsg;
+	helloMsg.mtype = SENDER_HELLO_TYPE;
+	helloMsg.transport = transport;
+	helloMsg.fileSize = fileSize;
+	helloMsg.address = address;
+	helloMsg.ringId = ringId;
+	helloMsg.reader = reader;
+	helloMsg.sealed = sealed;
+	memcpy(helloMsg.salt, sealSalt, sizeof(sealSalt));
+	if (msgsnd(msqid, &helloMsg, MSG_BODY_SIZE(helloMsg), 0) == -1) {
+		fprintf(stderr, "failed to send message to receiver: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Broadcasts the file to several receivers through the slot ring. Each
+ * slot is read from the file once and reused only after the slowest
+ * receiver has written it out.
+ * @param io - the file to send
+ * @param readerCount - the number of receivers
+ * @return the bytes sent, or -1 on failure
+ */
+template <class IO>
+long sendBcast(IO& io, int readerCount)
+{
+	if ((ringPtr = ringCreate(ringId, readerCount, pinnedCpu != -1)) == (ring*)-1) {
+		return -1;
+	}
+
+	/* Each receiver claims its record in the ring once attached */
+	if (!watch.start(&channelHead(sharedMemPtr)->owners[OWNER_SENDER], ringPtr->readers, readerCount, receiverGone)) {
+		ringRemove(ringId, ringPtr);
+		return -1;
+	}
+
+	/* One setup message per receiver, each naming its own cursor */
+	for (int reader = 0; reader < readerCount; reader++) {
+		if (!sendHello(TRANSPORT_BCAST, 0, reader)) {
+			ringRemove(ringId, ringPtr);
+			return -1;
+		}
+	}
+	fprintf(stdout, "Broadcasting to %d receivers\n", readerCount);
+
+	/* A receiver that never starts would be waited for forever */
+	int missing = ringAwaitReaders(ringPtr, BCAST_JOIN_MS);
+	if (missing > 0) {
+		fprintf(stderr, "%d of %d receivers did not start within %d seconds\n", missing, readerCount, BCAST_JOIN_MS / 1000);
+		hello unclaimed;
+		while (msgrcv(msqid, &unclaimed, MSG_BODY_SIZE(unclaimed), SENDER_HELLO_TYPE, IPC_NOWAIT) != -1) {
+		}
+	}
+	if (missing == readerCount) {
+		/* No receiver is left to remove the queue */
+		watch.stop();
+		ringRemove(ringId, ringPtr);
+		ipcRemove(shmid, msqid);
+		shmid = msqid = -1;
+		return -1;
+	}
+
+	RingSegment segment(ringPtr);
+	FutexNotify notify(ringPtr, -1, peerWait);
+	Sender<RingSegment, FutexNotify, IO> sender(segment, notify, io, reportProgress);
+	long result = sender.run();
+
+	/* The file still reached the receivers that lived */
+	int dropped = notify.droppedCount();
+	if (dropped > missing) {
+		fprintf(stderr, "%d of %d receivers died mid-transfer\n", dropped - missing, readerCount);
+		result = dropped == readerCount ? -1 : result;
+	}
+	watch.stop();
+	ringRemove(ringId, ringPtr);
+	return result;
+}
+
+/**
+ * Sends the file through the slots of the shared memory segment
+ * @param io - the file to send
+ * @return the bytes sent, or -1 on failure
+ */
+template <class IO>
+long sendShm(IO& io)
+{
+	ShmSegment segment(channelData(sharedMemPtr), SHARED_MEMORY_CHUNK_SIZE, SHARED_MEMORY_SLOT_COUNT);
+	QueueNotify notify(msqid, peerWait);
+	Sender<ShmSegment, QueueNotify, IO> sender(segment, notify, io, reportProgress);
+	return sender.run();
+}
+
+/**
+ * Sends the file over a socket to the receiver listening on socketAddress
+ * @param io - the file to send
+ * @return the bytes sent, or -1 on failure
+ */
+long sendSocket(StdioIO& io)
+{
+	int sock = socketConnect(socketAddress);
+	if (sock == -1) {
+		return -1;
+	}
+	SocketStream stream(sock, fileSize);
+	StreamNotify notify;
+	Sender<SocketStream, StreamNotify, StdioIO> sender(stream, notify, io, reportProgress);
+	long result = sender.run();
+
+	const socketStats& stats = stream.sendStats();
+	fprintf(stdout, "%ld sendmsg calls, %ld with MSG_ZEROCOPY, %ld of those copied by the kernel\n",
+		stats.calls, stats.zerocopy, stats.copied);
+	close(sock);
+	return result;
+}
+
 /**
  * The main send function
  * @param fileName - the name of the file
+ * @param transport - the requested TRANSPORT_ value
+ * @param readerCount - the number of receivers (TRANSPORT_BCAST only)
+ * @return the bytes sent, or -1 on failure
  */
-void send(const char* fileName)
+long send(const char* fileName, int transport, int readerCount)
 {
 	/* Open the file for reading */
 	FILE* fp = fopen(fileName, "r");
 
 	struct stat statbuf;
-	int sentFileSize = 0;
 
-	int result = 0; // most recent error code
-	bool waiting = true;
+	/* The bytes sent, or -1 */
+	long result = -1;
 
-	/* A buffer to store message we will send to the receiver. */
-	message sndMsg; 
-	
-	/* A buffer to store message received from the receiver. */
-	message rcvMsg;
-	
 	/* Was the file open? */
 	if(!fp)
 	{
@@ -113,83 +267,100 @@ void send(const char* fileName)
 	}
 
 	// get file information since the file size is required
-	if (stat(fileName, &statbuf) == -1) {
-  		// This error case may not be possible, since fopen probably will fail first
+	if (fstat(fileno(fp), &statbuf) == -1) {
 		fprintf(stderr, "File does not exist or is not accessible: %s\n", fileName);
 		fclose(fp);
-		return;
+		return -1;
 	}
+	fileSize = S_ISREG(statbuf.st_mode) ? statbuf.st_size : 0;
+
 	// display the file name
 	fprintf(stdout, "Sending %s\n", fileName);
 
-	
-	/* Read the whole file */
-	while(!feof(fp))
-	{
-		/* Read at most SHARED_MEMORY_CHUNK_SIZE from the file and store them in shared memory. 
- 		 * fread will return how many bytes it has actually read (since the last chunk may be less
- 		 * than SHARED_MEMORY_CHUNK_SIZE).
- 		 */
-		if((sndMsg.size = fread(sharedMemPtr, sizeof(char), SHARED_MEMORY_CHUNK_SIZE, fp)) < 0)
-		{
-			perror("failed to read from file. Was the receiver process killed?\n");
-			cleanUp(shmid, msqid, sharedMemPtr);
-			fclose(fp);
-			exit(-1);
-		}
+	StdioIO io(fp);
+
+	/* With -K every chunk is sealed on its way into the slots */
+	SealCipher cipher;
+	SealedIO<StdioIO> sealedIO(io, cipher);
+	sealedFile = sealed ? &sealedIO : NULL;
+	if (sealed && (!sealNewSalt(sealSalt) || !cipher.init(sealKey, sealSalt))) {
+		fclose(fp);
+		return -1;
+	}
 
-		// Report the file transfer status to stdout 
-		sentFileSize += sndMsg.size;
-		fprintf(stdout, "File transfer: %.2lf%%. %s\n", 
-			sentFileSize * 100.0 /statbuf.st_size, (waiting ? " Waiting for receiver..." : ""));
-		fflush(stdout);
-
-		/* Send a message to the receiver telling him that the data is ready 
- 		 * (message of type SENDER_DATA_TYPE) 
- 		 */
-		sndMsg.mtype = SENDER_DATA_TYPE;
-		fprintf(stdout, "Sending message to recv for %d bytes. ", sndMsg.size);
-		result = msgsnd(msqid, &sndMsg, sizeof(sndMsg), 0);
-		if (result == -1) {
-			fprintf(stderr, "failed to send message to receiver: Was the receiver process killed?\n");
-			break;
+	/* Fall back to the shared memory segment if the file cannot be
+	   spliced or mapped */
+	if (transport == TRANSPORT_SPLICE && !canSplice(io.fd())) {
+		fprintf(stdout, "%s cannot be spliced, using shared memory instead\n", fileName);
+		transport = TRANSPORT_SHM;
+	}
+	void* fileMap = MAP_FAILED;
+	if (transport == TRANSPORT_CMA && (fileMap = cmaMap(io.fd(), fileSize)) == MAP_FAILED) {
+		fprintf(stdout, "%s cannot be mapped, using shared memory instead\n", fileName);
+		transport = TRANSPORT_SHM;
+	}
+
+	channelHeader* header = channelHead(sharedMemPtr);
+	if (socketAddress != NULL) {
+		result = sendSocket(io);
+	} else if (transport == TRANSPORT_BCAST) {
+		result = sealed ? sendBcast(sealedIO, readerCount) : sendBcast(io, readerCount);
+	} else if (watch.start(&header->owners[OWNER_SENDER], &header->owners[OWNER_RECEIVER], 1, receiverGone) &&
+		sendHello(transport, (unsigned long)fileMap, -1)) {
+		if (transport == TRANSPORT_SPLICE) {
+			SpliceFifo fifo;
+			QueueNotify notify(msqid, peerWait);
+			Sender<SpliceFifo, QueueNotify, StdioIO> sender(fifo, notify, io, reportProgress);
+			result = sender.run();
 		}
-		/* Wait until the receiver sends us a message of type RECV_DONE_TYPE telling us 
- 		 * that he finished saving the memory chunk. 
- 		 */ 
-	    result = msgrcv(msqid, &rcvMsg, sizeof(rcvMsg), RECV_DONE_TYPE, 0);
-		fprintf(stdout, "Received message from recv. ");
-
-		if (result == -1) {
-			fprintf(stderr, "failed to receive message from receiver: Was the receiver process killed?\n");
-			break;
+		if (transport == TRANSPORT_CMA) {
+			fprintf(stdout, "Waiting for receiver to read %ld bytes...\n", fileSize);
+			fflush(stdout);
+			CmaMapping mapping(0, (unsigned long)fileMap, fileSize);
+			QueueNotify notify(msqid, peerWait);
+			Sender<CmaMapping, QueueNotify, StdioIO> sender(mapping, notify, io);
+			result = sender.run();
+			if (result == XFER_FALLBACK) {
+				fprintf(stdout, "Receiver cannot read our memory, using shared memory instead\n");
+				transport = TRANSPORT_SHM;
+			}
 		}
-		waiting = false; // no longer waiting for the receiver to start reading data
-
-	}
-	
-	if (result != -1) {
-		/** once we are out of the above loop, we have finished sending the file.
-		 * Lets tell the receiver that we have nothing more to send. We will do this by
-		 * sending a message of type SENDER_DATA_TYPE with size field set to 0.
-		 * 
-		 * This is only done if there have been no errors previously. 	
-		 */ 
-
-		sndMsg.mtype = SENDER_DATA_TYPE;
-		sndMsg.size = 0;
-		fprintf(stdout, "\nSending message to recv that file transfer is finished.\n");
-		result = msgsnd(msqid, &sndMsg, sizeof(sndMsg), 0);
-		if (result != -1) {
-			fprintf(stdout, "File transfer complete (%d bytes)                    \n", sentFileSize);
-		} else {
-			fprintf(stdout, "Sending message to receiver failed: Was the receiver process killed?\n");
+		if (transport == TRANSPORT_DEDUP) {
+			DedupSegment segment(channelData(sharedMemPtr));
+			QueueNotify notify(msqid, peerWait);
+			Sender<DedupSegment, QueueNotify, StdioIO> sender(segment, notify, io, reportProgress);
+			result = sender.run();
+			if (result >= 0) {
+				fprintf(stdout, "Sent %ld of %ld bytes; the receiver had the rest\n", segment.sentBytes(), result);
+			}
 		}
+		if (transport == TRANSPORT_SHM) {
+			result = sealed ? sendShm(sealedIO) : sendShm(io);
+		}
+	}
+	/* Counted without the tags */
+	if (sealed && result >= 0) {
+		result = sealedIO.bytes();
+	}
+	if (fileMap != MAP_FAILED) {
+		cmaUnmap(fileMap, fileSize);
+	}
+
+	if (result >= 0) {
+		/* Done with the receivers: exiting now is not dying on them */
+		if (socketAddress == NULL) {
+			ownerRelease(&header->owners[OWNER_SENDER]);
+		}
+		fprintf(stdout, "File transfer complete (%ld bytes)                    \n", result);
 	} else {
 		fprintf(stdout, "File transfer failed\n");
 	}
-	/* Close the file */
-	fclose(fp);	 
+	/* Close the file, once the sealing thread has let go of it */
+	sealedIO.stop();
+	sealedFile = NULL;
+	fclose(fp);
+
+	return result;
 }
 
 /**
@@ -206,25 +377,93 @@ void ctrlCSignal(int signal)
 
 int main(int argc, char** argv)
 {
-	
+	/* The transport to send the file over */
+	int transport = TRANSPORT_SHM;
+
+	/* The number of receivers to broadcast to */
+	int readerCount = 1;
+
+	/* Where to dump the protocol trace, or NULL */
+	const char* tracePath = NULL;
+	int opt;
+
 	/* Check the command line arguments */
-	if(argc < 2)
+	while ((opt = getopt(argc, argv, "t:n:w:c:T:K:a:")) != -1)
+	{
+		if (opt == 't' && strcmp(optarg, "shm") == 0) {
+			transport = TRANSPORT_SHM;
+		} else if (opt == 't' && strcmp(optarg, "splice") == 0) {
+			transport = TRANSPORT_SPLICE;
+		} else if (opt == 't' && strcmp(optarg, "cma") == 0) {
+			transport = TRANSPORT_CMA;
+		} else if (opt == 't' && strcmp(optarg, "bcast") == 0) {
+			transport = TRANSPORT_BCAST;
+		} else if (opt == 't' && strcmp(optarg, "dedup") == 0) {
+			transport = TRANSPORT_DEDUP;
+		} else if (opt == 'n' && atoi(optarg) > 0 && atoi(optarg) <= BCAST_MAX_READERS) {
+			readerCount = atoi(optarg);
+		} else if (opt == 'w' && parseWaitStrategy(optarg) != -1) {
+			peerWait.kind = parseWaitStrategy(optarg);
+		} else if (opt == 'c') {
+			pinnedCpu = atoi(optarg);
+		} else if (opt == 'T') {
+			tracePath = optarg;
+		} else if (opt == 'K') {
+			/* sealLoadKey has said what is wrong with the key file */
+			if (!sealLoadKey(optarg, sealKey)) {
+				exit(-1);
+			}
+			sealed = true;
+		} else if (opt == 'a') {
+			socketAddress = optarg;
+		} else {
+			argc = 0; // print the usage below
+		}
+	}
+	if(optind >= argc)
 	{
 		fprintf(stdout, "send - sends data to a receiver\n");
-		fprintf(stderr, "USAGE: %s <FILE NAME>\n", argv[0]);
+		fprintf(stderr, "USAGE: %s [-t shm|splice|cma|bcast|dedup] [-n receivers]\n"
+			"       [-w block|spin|adaptive] [-c cpu] [-T trace file] [-K key file]\n"
+			"       [-a unix:<path>|tcp:[<host>:]<port>] <FILE NAME>\n", argv[0]);
+		exit(-1);
+	}
+	/* Only chunks that go through the slots can be sealed */
+	if (sealed && transport != TRANSPORT_SHM && transport != TRANSPORT_BCAST) {
+		fprintf(stderr, "-K works with the shm and bcast transports only\n");
+		exit(-1);
+	}
+	/* A socket carries the file by itself, as it is */
+	if (socketAddress != NULL && (sealed || transport != TRANSPORT_SHM || readerCount != 1)) {
+		fprintf(stderr, "-a cannot be combined with -t, -n or -K\n");
 		exit(-1);
 	}
 	// register Ctrl+C handler
 	signal(SIGINT, ctrlCSignal);
-	
+
+	// a receiver that dies mid-splice should fail the transfer, not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pinnedCpu != -1 && pinToCpu(pinnedCpu) == -1) {
+		fprintf(stderr, "Failed to pin to CPU %d: %s\n", pinnedCpu, strerror(errno));
+		exit(-1);
+	}
+
+	/* Record the protocol's events, dumped at exit */
+	if (tracePath != NULL && !traceStart(tracePath, "send")) {
+		exit(-1);
+	}
+
 	/* Connect to shared memory and the message queue */
-	init(shmid, msqid, sharedMemPtr);
-	
+	if (socketAddress == NULL) {
+		init(shmid, msqid, sharedMemPtr);
+	}
+
 	/* Send the file */
-	send(argv[1]);
-	
+	long result = send(argv[optind], transport, readerCount);
+
 	/* Cleanup */
 	cleanUp(shmid, msqid, sharedMemPtr);
-		
-	return 0;
+
+	return result < 0 ? 1 : 0;
 }
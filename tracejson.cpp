@@ -0,0 +1,225 @@
+/* tracejson - turns the trace dumps of send and recv (-T) into Chrome
+   trace JSON, for chrome://tracing or ui.perfetto.dev. Both processes
+   time their events on CLOCK_MONOTONIC, so they share one timeline, and
+   every chunk the sender announces gets an arrow to the moment each
+   receiver woke up for it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+#include "ipcxfer/trace.h"
+
+/**
+ * One thread's events from a dump
+ */
+
+struct threadTrace
+{
+	int tid;
+	std::vector<traceEvent> events;
+};
+
+/**
+ * One process's dump
+ */
+
+struct processTrace
+{
+	traceFile header;
+	std::vector<threadTrace> threads;
+};
+
+/* What the arg of each event kind means, or NULL if it has none */
+const char* const argNames[TRACE_EVENT_KINDS] = {
+	NULL, NULL, NULL, "bytes", "bytes", NULL, "bytes", "bytes", "bytes", "stall_ns", "credit", NULL, NULL
+};
+
+/* The earliest event in any dump; timestamps are printed relative to it */
+long long origin = -1;
+
+/* Separates the JSON events */
+bool firstEvent = true;
+
+/**
+ * Reads a trace dump
+ * @param path - the file
+ * @param trace - where to store it
+ * @return true on success
+ */
+bool readTrace(const char* path, processTrace& trace)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return false;
+	}
+	bool ok = fread(&trace.header, sizeof(trace.header), 1, fp) == 1 &&
+		memcmp(trace.header.magic, TRACE_MAGIC, sizeof(trace.header.magic)) == 0 &&
+		trace.header.version == TRACE_VERSION;
+	if (!ok) {
+		fprintf(stderr, "%s is not a trace dump\n", path);
+	}
+
+	for (int i = 0; ok && i < trace.header.threads; i++) {
+		traceThread thread;
+		threadTrace loaded;
+		ok = fread(&thread, sizeof(thread), 1, fp) == 1 && thread.count <= TRACE_RING_EVENTS;
+		if (ok) {
+			loaded.tid = thread.tid;
+			loaded.events.resize(thread.count);
+			ok = fread(loaded.events.data(), sizeof(traceEvent), thread.count, fp) == thread.count;
+		}
+		if (!ok) {
+			fprintf(stderr, "%s is truncated\n", path);
+		}
+		trace.threads.push_back(loaded);
+	}
+	fclose(fp);
+	return ok;
+}
+
+/**
+ * Starts one JSON event: everything but its arguments
+ * @param name - what it is shown as
+ * @param phase - the Chrome trace phase: B, E, i, X, s or f
+ * @param ns - when it happened
+ * @param pid - the process
+ * @param tid - the thread
+ */
+void beginEvent(const char* name, char phase, long long ns, int pid, int tid)
+{
+	fprintf(stdout, "%s\n{\"name\":\"%s\",\"cat\":\"xfer\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+		firstEvent ? "" : ",", name, phase, (ns - origin) / 1000.0, pid, tid);
+	firstEvent = false;
+}
+
+/**
+ * Prints one recorded event
+ * @param event - the event
+ * @param pid - the process
+ * @param tid - the thread
+ */
+void printEvent(const traceEvent& event, int pid, int tid)
+{
+	unsigned int kind = event.kind < TRACE_EVENT_KINDS ? event.kind : 0;
+	char phase = 'i';
+	if (kind == TRACE_CREDIT_WAIT_BEGIN || kind == TRACE_POST_WAIT_BEGIN ||
+		kind == TRACE_WRITE_BEGIN || kind == TRACE_ACK_WAIT_BEGIN) {
+		phase = 'B';
+	} else if (kind == TRACE_CREDIT_WAIT_END || kind == TRACE_POST_WAIT_END ||
+		kind == TRACE_WRITE_END || kind == TRACE_ACK_WAIT_END) {
+		phase = 'E';
+	}
+
+	beginEvent(traceEventName(kind), phase, event.ns, pid, tid);
+	if (phase == 'i') {
+		fprintf(stdout, ",\"s\":\"t\"");
+	}
+	fprintf(stdout, ",\"args\":{\"seq\":%u", event.seq);
+	if (argNames[kind] != NULL) {
+		fprintf(stdout, ",\"%s\":%lld", argNames[kind], event.arg);
+	}
+	fprintf(stdout, "}}");
+}
+
+/**
+ * Prints a slice between two recorded events
+ * @param name - what it is shown as
+ * @param from - the event it starts at
+ * @param to - the event it ends at
+ * @param pid - the process
+ * @param tid - the thread
+ */
+void printSlice(const char* name, const traceEvent& from, const traceEvent& to, int pid, int tid)
+{
+	beginEvent(name, 'X', from.ns, pid, tid);
+	fprintf(stdout, ",\"dur\":%.3f,\"args\":{\"seq\":%u,\"bytes\":%lld}}", (to.ns - from.ns) / 1000.0, from.seq, from.arg);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stdout, "tracejson - turns send and recv trace dumps into Chrome trace JSON\n");
+		fprintf(stderr, "USAGE: %s <TRACE FILE> [TRACE FILE ...] > trace.json\n", argv[0]);
+		exit(-1);
+	}
+
+	std::vector<processTrace> traces(argc - 1);
+	for (int i = 1; i < argc; i++) {
+		if (!readTrace(argv[i], traces[i - 1])) {
+			exit(-1);
+		}
+	}
+	for (const processTrace& trace : traces) {
+		for (const threadTrace& thread : trace.threads) {
+			for (const traceEvent& event : thread.events) {
+				origin = origin == -1 || event.ns < origin ? event.ns : origin;
+			}
+		}
+	}
+
+	fprintf(stdout, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (const processTrace& trace : traces) {
+		int pid = trace.header.pid;
+		fprintf(stdout, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%.20s %d\"}}",
+			firstEvent ? "" : ",", pid, trace.header.role, pid);
+		firstEvent = false;
+
+		for (const threadTrace& thread : trace.threads) {
+			const traceEvent* waited = NULL;
+			const traceEvent* filled = NULL;
+			for (const traceEvent& event : thread.events) {
+				printEvent(event, pid, thread.tid);
+
+				/* The sender's time between waits: reading the slot, then announcing it */
+				if (event.kind == TRACE_CREDIT_WAIT_END) {
+					waited = &event;
+				} else if (event.kind == TRACE_SLOT_FILLED && waited != NULL && waited->seq == event.seq) {
+					printSlice("read", *waited, event, pid, thread.tid);
+					filled = &event;
+				} else if (event.kind == TRACE_NOTIFY_SENT && filled != NULL && filled->seq == event.seq) {
+					printSlice("notify", *filled, event, pid, thread.tid);
+				}
+			}
+		}
+	}
+
+	/* An arrow from every announcement to each receiver's wakeup. It
+	   starts inside the sender's notify slice and ends just inside the
+	   receiver's wait, so viewers bind it to both. */
+	long long flowId = 0;
+	for (const processTrace& receiver : traces) {
+		for (const threadTrace& recvThread : receiver.threads) {
+			/* The receiver's wakeups by chunk number */
+			std::unordered_map<unsigned int, const traceEvent*> wakeups;
+			for (const traceEvent& woke : recvThread.events) {
+				if (woke.kind == TRACE_POST_WAIT_END) {
+					wakeups.emplace(woke.seq, &woke);
+				}
+			}
+			if (wakeups.empty()) {
+				continue;
+			}
+
+			for (const processTrace& sender : traces) {
+				for (const threadTrace& sendThread : sender.threads) {
+					for (const traceEvent& sent : sendThread.events) {
+						auto woke = wakeups.find(sent.seq);
+						if (sent.kind != TRACE_NOTIFY_SENT || woke == wakeups.end() || woke->second->ns < sent.ns) {
+							continue;
+						}
+						beginEvent("notify", 's', sent.ns - 1, sender.header.pid, sendThread.tid);
+						fprintf(stdout, ",\"id\":%lld}", flowId);
+						beginEvent("notify", 'f', woke->second->ns - 1, receiver.header.pid, recvThread.tid);
+						fprintf(stdout, ",\"bp\":\"e\",\"id\":%lld}", flowId);
+						flowId++;
+					}
+				}
+			}
+		}
+	}
+	fprintf(stdout, "\n]}\n");
+	return 0;
+}